@@ -13,52 +13,148 @@
 #include <sys/select.h>
 #include <strings.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <endian.h>
+#include <time.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include "latency.h"
+#include "protocol.h"
 
 #define STDIN_FILENO		0
 #define STDOUT_FILENO		1
 
 #define SERVER				"0.0.0.0"
 #define PORT				"6666"
-#define PSEUDO_LEN			15
 #define MAX_BUFF			512
 #define MAX_CLIENTS			12
+#define OUT_BUFF			65536			// what we print is written out in chunks this large
+
+#define RECONNECT_TRIES		10				// attempts before giving up on the server
+#define RECONNECT_BASE_MS	250				// first backoff ceiling, doubled on every attempt
+#define RECONNECT_MAX_MS	30000			// backoff ceiling
+
+#define MAX_SESSIONS		512				// sessions a headless client can run at once
+#define SCRIPT_BUFF			65536			// longest script line
+#define TX_HIGH_WATER		(1 << 18)		// stop reading the script while a session has this much to send
+
+#define INFLATE_MAX			(1 << 23)		// largest batch of frames a compressed frame may hold
 
 #define MENU				"/menu"
 #define QUIT				"/quit"
 #define LIST				"/list"
 #define KICK				"/kick"
 #define CHANGE				"/change"
+#define PASTE				"/paste"
+#define SEARCH				"/search"
+#define TRACE				"/trace"
+#define PASTE_END			"."
 
 const char *SERVER_CLOSE_MESSAGE = "Nantes chat has closed its servers, goodbye";
 const char *CONNECTION_ESTABLISHED = "Connection established with the server";
 
-typedef enum CLIENT_TYPE
-{
-	REGULAR, ADMINISTRATOR
-} client_type;
-
-typedef enum CLIENT_STATUS
-{
-	VISIBLE, INVISIBLE
-} client_status;
-
 typedef struct CLIENT_INFO
 {
 	int sock;								// socket to send / recv data
 	char ip[INET6_ADDRSTRLEN];				// server ip
 	char port[5];							// server port
-	char pseudo[15];
+	char pseudo[PSEUDO_LEN];
 	client_type type;
 	client_status status;
+	char *unix_path;						// connect to this unix socket instead of TCP
+	uint32_t caps;							// transports to ask the server for
 } client_info;
 
+typedef enum TRACE_STAGE
+{
+	STAGE_STDIN,							// input -> send
+	STAGE_UPLINK,							// send -> recv: sender socket and kernel queues
+	STAGE_PARSE,							// recv -> dispatch
+	STAGE_HANDLE,							// dispatch -> enqueue
+	STAGE_DOWNLINK,							// enqueue -> delivered: fan-out and our socket
+	STAGE_TOTAL,							// input -> delivered
+	TRACE_STAGES
+} trace_stage;
+
+// what the client needs to resume its session after losing the connection
+typedef struct SESSION
+{
+	unsigned char token[TOKEN_LEN];			// all zero until the server sent one
+	uint64_t last_seq;						// last chat message received
+	int kicked;
+	const char *record;						// headless: frames are written as records under this name
+	const char *pseudo;						// written with the traces
+	uint64_t connected_at;					// traced messages enqueued before were replayed
+	unsigned long delivered;				// headless: records written
+} session;
+
+typedef struct SHM_LINK
+{
+	shm_ring *ring;							// NULL when everything comes through the socket
+	size_t map_len;
+	int efd;								// eventfd the server writes to wake us up
+	uint32_t dropped;						// drops already reported
+	char *frame;							// a frame copied out of the ring
+} shm_link;
+
+// bytes received from the server that do not form a complete frame yet
+typedef struct CLIENT_RX
+{
+	char *buf;
+	size_t len;
+	size_t cap;
+} client_rx;
+
+// one chat identity of a headless client
+typedef struct BOT
+{
+	client_info ci;
+	session sess;
+	client_rx rx;
+	char *tx;								// frames waiting for the next write
+	size_t tx_len;
+	size_t tx_off;							// already written
+	size_t tx_cap;
+	unsigned long sent;						// frames queued by the script
+	int quitting;							// /quit queued, nothing else is sent
+} bot;
+
+// -c: undoes what the server compressed, one context for every session of the process
+typedef struct DECOMPRESSOR
+{
+	z_stream zs;
+	uint32_t dict_id;						// adler32 of the dictionary, must match the server's
+	char *buf;								// the inflated frames
+	size_t cap;
+	uint64_t wire;							// compressed bytes received
+	uint64_t inflated;						// what they became
+} decompressor;
+
+const char *stage_names[] = { "stdin", "uplink", "parse", "handle", "downlink", "total" };
+
+decompressor inflater;
+FILE *trace_out = NULL;						// -t: chat messages are traced, deliveries written here
+stage_stats trace_stats[TRACE_STAGES];
+uint64_t trace_id;							// last id given to a traced message
+
 void die_error(const char *msg);
-client_info *fill_client_info(char *ip, char *port, char *pseudo, client_type type, client_status status);
+void fill_client_info(client_info *ci, char *ip, char *port, char *pseudo, client_type type, client_status status);
 void print_client_info(client_info *ci);
-void client_create_socket_and_connect(client_info *ci);
-int send_client_info(client_info *ci);
+int client_create_socket_and_connect(client_info *ci);
+int send_client_info(client_info *ci, session *sess);
+void send_frame(int sock, frame_type type, const char *payload, size_t len);
+void send_frame_parts(int sock, frame_type type, const char *head, size_t head_len, const char *payload, size_t len);
+void send_chat(int sock, const char *msg, size_t len, uint64_t input);
 void send_message(int sock, const char *msg);
-int recv_message(int sock, char *out_buffer, int buffer_len);
+int recv_frames(int sock, client_rx *rx, session *sess);
+void handle_frame(session *sess, frame_hdr *hdr, const char *payload);
+void write_record(const char *pseudo, const char *kind, uint64_t seq, const char *payload);
 
 void print_menu()
 {
@@ -66,62 +162,538 @@ void print_menu()
 						"/list: list of people that are connected\n"\
 						"@pseudo: send a private message to [pseudo]\n"\
 						"/kick: kick a user out\n"
+						"/search [from:pseudo] [words]: newest messages holding all the words\n"
+						"/trace: latency of the traced messages through the server\n"
+						"/paste: send the following lines as one message, end with a line holding a single .\n"
 						"/quit: quitter le chat\n";
 	
 	fprintf(stderr, "%s", menu);
 }
 
-void recv_list_of_clients(int client_sock)
+/*
+ * read lines from stdin until a line holding only PASTE_END and append them to msg_buf
+ * return value: length of the text in msg_buf
+*/
+size_t read_paste(char *msg_buf, size_t len, size_t size)
+{
+	char line[MAX_BUFF];
+	size_t line_len;
+	
+	fprintf(stderr, "Paste your text, end with a line holding a single %s\n", PASTE_END);
+	fflush(stderr);
+	while( fgets(line, sizeof(line), stdin) != NULL )
+	{
+		line_len = strlen(line);
+		if( !strcmp(line, PASTE_END "\n") || !strcmp(line, PASTE_END) )
+		{
+			break;
+		}
+		if( len + line_len >= size )
+		{
+			fprintf(stderr, "Info: paste truncated to %d bytes\n", MAX_PAYLOAD);
+			break;
+		}
+		memcpy(msg_buf + len, line, line_len);
+		len += line_len;
+	}
+	// no trailing newline, like a regular message
+	if( len > 0 && msg_buf[len - 1] == '\n' )
+	{
+		len -= 1;
+	}
+	msg_buf[len] = '\0';
+	
+	return len;
+}
+
+/*
+ * per stage breakdown of the traced messages received, one csv line per stage
+ * return value: length written to out
+*/
+int stage_report(char *out, size_t size)
+{
+	return stage_format(out, size, "", stage_names, trace_stats, TRACE_STAGES);
+}
+
+/*
+ * fill the stamps of a chat message about to be sent
+ * input: when the line was read, CLOCK_MONOTONIC nanoseconds
+*/
+void trace_stamp(trace_stamps *tr, uint64_t input)
+{
+	memset(tr, 0, sizeof(trace_stamps));
+	trace_id += 1;
+	tr->id = htobe64(((uint64_t)getpid() << 32) | trace_id);
+	tr->input = htobe64(input);
+	tr->send = htobe64(monotonic_ns());
+	
+	return;
+}
+
+// a traced message reached a session: write its stamps out and add them to the breakdown
+void trace_delivered(session *sess, const char *payload)
+{
+	uint64_t deliver = monotonic_ns();
+	trace_stamps tr;
+	
+	memcpy(&tr, payload, sizeof(tr));
+	tr.id = be64toh(tr.id);
+	tr.input = be64toh(tr.input);
+	tr.send = be64toh(tr.send);
+	tr.recv = be64toh(tr.recv);
+	tr.dispatch = be64toh(tr.dispatch);
+	tr.enqueue = be64toh(tr.enqueue);
+	if( tr.enqueue < sess->connected_at )
+	{
+		// replayed from the history when joining or resuming, it did not travel now
+		return;
+	}
+	
+	fprintf(trace_out, "%llx,%s,%llu,%llu,%llu,%llu,%llu,%llu\n", (unsigned long long)tr.id, sess->pseudo,
+			(unsigned long long)tr.input, (unsigned long long)tr.send, (unsigned long long)tr.recv,
+			(unsigned long long)tr.dispatch, (unsigned long long)tr.enqueue, (unsigned long long)deliver);
+	stage_add(&trace_stats[STAGE_STDIN], tr.input, tr.send, deliver);
+	stage_add(&trace_stats[STAGE_UPLINK], tr.send, tr.recv, deliver);
+	stage_add(&trace_stats[STAGE_PARSE], tr.recv, tr.dispatch, deliver);
+	stage_add(&trace_stats[STAGE_HANDLE], tr.dispatch, tr.enqueue, deliver);
+	stage_add(&trace_stats[STAGE_DOWNLINK], tr.enqueue, deliver, deliver);
+	stage_add(&trace_stats[STAGE_TOTAL], tr.input, deliver, deliver);
+	
+	return;
+}
+
+/*
+ * a FRAME_DEFLATE holds whole frames compressed with the shared dictionary,
+ * inflate them and handle them as if they came one by one
+*/
+void inflate_frames(session *sess, const char *payload, size_t len)
+{
+	uint32_t info[2];
+	size_t done = 0, inner_len, need;
+	frame_hdr hdr;
+	char saved;
+	
+	if( len < sizeof(info) )
+	{
+		return;
+	}
+	memcpy(info, payload, sizeof(info));
+	if( ntohl(info[0]) != inflater.dict_id || ntohl(info[1]) > INFLATE_MAX )
+	{
+		fprintf(stderr, "Info: compressed message with an unknown dictionary, dropped\n");
+		return;
+	}
+	
+	size_t out = ntohl(info[1]);
+	if( out + 1 > inflater.cap )
+	{
+		char *grown = realloc(inflater.buf, out + 1);
+		if( grown == NULL )
+		{
+			die_error("inflate buffer");
+		}
+		inflater.buf = grown;
+		inflater.cap = out + 1;
+	}
+	
+	inflateReset(&inflater.zs);
+	inflateSetDictionary(&inflater.zs, (const Bytef *)compress_dict, sizeof(compress_dict) - 1);
+	inflater.zs.next_in = (Bytef *)payload + sizeof(info);
+	inflater.zs.avail_in = len - sizeof(info);
+	inflater.zs.next_out = (Bytef *)inflater.buf;
+	inflater.zs.avail_out = out;
+	if( inflate(&inflater.zs, Z_FINISH) != Z_STREAM_END || inflater.zs.avail_out != 0 )
+	{
+		fprintf(stderr, "Info: invalid compressed message from the server\n");
+		return;
+	}
+	inflater.wire += sizeof(frame_hdr) + len;
+	inflater.inflated += out;
+	
+	while( out - done >= sizeof(frame_hdr) )
+	{
+		memcpy(&hdr, inflater.buf + done, sizeof(hdr));
+		inner_len = ntohl(hdr.len);
+		need = sizeof(frame_hdr) + inner_len;
+		if( inner_len > MAX_PAYLOAD || out - done < need )
+		{
+			break;
+		}
+		char *inner = inflater.buf + done + sizeof(frame_hdr);
+		saved = inner[inner_len];
+		inner[inner_len] = '\0';
+		// never nested
+		if( ntohl(hdr.type) != FRAME_DEFLATE )
+		{
+			handle_frame(sess, &hdr, inner);
+		}
+		inner[inner_len] = saved;
+		done += need;
+	}
+	
+	return;
+}
+
+/*
+ * print a frame received from the server and keep track of the session
+*/
+void handle_frame(session *sess, frame_hdr *hdr, const char *payload)
+{
+	uint64_t seq = be64toh(hdr->seq);
+	
+	if( ntohl(hdr->type) == FRAME_DEFLATE )
+	{
+		inflate_frames(sess, payload, ntohl(hdr->len));
+		return;
+	}
+	
+	if( seq != 0 )
+	{
+		// a replay can overlap with what we already have
+		if( seq <= sess->last_seq )
+		{
+			return;
+		}
+		sess->last_seq = seq;
+	}
+	
+	if( ntohl(hdr->type) == FRAME_TRACED )
+	{
+		if( ntohl(hdr->len) < sizeof(trace_stamps) )
+		{
+			return;
+		}
+		if( trace_out != NULL )
+		{
+			trace_delivered(sess, payload);
+		}
+		payload += sizeof(trace_stamps);
+	}
+	
+	if( sess->record != NULL )
+	{
+		// headless: the token is useless since a headless session does not reconnect
+		switch( ntohl(hdr->type) )
+		{
+			case FRAME_SESSION:
+				return;
+			case FRAME_KICKED:
+				sess->kicked = 1;
+				write_record(sess->record, "kicked", seq, payload);
+				break;
+			case FRAME_LIST:
+				write_record(sess->record, "list", seq, payload);
+				break;
+			default:
+				write_record(sess->record, "text", seq, payload);
+				break;
+		}
+		sess->delivered += 1;
+		return;
+	}
+	
+	switch( ntohl(hdr->type) )
+	{
+		case FRAME_LIST:
+			fprintf(stderr, "LIST OF CLIENTS\n%s", payload);
+			break;
+		case FRAME_SESSION:
+			if( ntohl(hdr->len) == TOKEN_LEN + 1 )
+			{
+				memcpy(sess->token, payload, TOKEN_LEN);
+				if( payload[TOKEN_LEN] )
+				{
+					fprintf(stderr, "Info: session resumed\n");
+				}
+				else
+				{
+					// a new session (the server restarted for example) numbers its messages from 1 again
+					sess->last_seq = 0;
+				}
+			}
+			break;
+		case FRAME_KICKED:
+			sess->kicked = 1;
+			fprintf(stderr, "%s\n", payload);
+			break;
+		case FRAME_TEXT:
+		default:
+			fprintf(stderr, "%s\n", payload);
+			break;
+	}
+	
+	return;
+}
+
+/*
+ * read the answer to CAP_SHM, the first frame the server sends when the transport was requested
+ * return value: 0 when the ring is mapped or the server refused (link->ring stays NULL and
+ * everything comes through the socket), -1 if the connection was lost
+*/
+int shm_accept(int sock, shm_link *link)
+{
+	frame_hdr hdr;
+	uint32_t ring_size;
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int) * 2)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	int fds[2] = { -1, -1 };
+	
+	memset(link, 0, sizeof(shm_link));
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	
+	// the descriptors travel with the first byte of the frame
+	if( recvmsg(sock, &msg, MSG_WAITALL) != sizeof(hdr) || ntohl(hdr.type) != FRAME_SHM )
+	{
+		perror("recv shared memory answer");
+		return -1;
+	}
+	for( cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm) )
+	{
+		if( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(sizeof(fds)) )
+		{
+			memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+		}
+	}
+	if( ntohl(hdr.len) != sizeof(ring_size) || fds[0] == -1 )
+	{
+		fprintf(stderr, "Info: shared memory refused, using the socket\n");
+		return 0;
+	}
+	if( recv(sock, &ring_size, sizeof(ring_size), MSG_WAITALL) != sizeof(ring_size) )
+	{
+		perror("recv shared memory size");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	
+	link->map_len = sizeof(shm_ring) + ntohl(ring_size);
+	link->ring = mmap(NULL, link->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if( link->ring == MAP_FAILED )
+	{
+		die_error("mmap shared memory");
+	}
+	link->efd = fds[1];
+	link->frame = malloc(MAX_PAYLOAD + 1);
+	if( link->frame == NULL )
+	{
+		die_error("frame buffer");
+	}
+	fprintf(stderr, "Info: using the shared memory transport\n");
+	
+	return 0;
+}
+
+void shm_copy_out(shm_ring *ring, uint32_t pos, char *dst, size_t len)
+{
+	uint32_t off = pos & (ring->size - 1);
+	size_t first = ring->size - off;
+	if( first > len )
+	{
+		first = len;
+	}
+	memcpy(dst, ring->data + off, first);
+	memcpy(dst + first, ring->data, len - first);
+	
+	return;
+}
+
+// handle every frame waiting in the ring
+void shm_drain(shm_link *link, session *sess)
 {
-	// can have maximum no of clients connected
-	int names_buffer_len = (MAX_CLIENTS * PSEUDO_LEN) + (PSEUDO_LEN * 2);
-	char *names_buffer = calloc(names_buffer_len, sizeof(char));
+	shm_ring *ring = link->ring;
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_seq_cst);
+	uint32_t len, dropped;
+	frame_hdr hdr;
+	
+	while( tail != head )
+	{
+		shm_copy_out(ring, tail, (char *)&hdr, sizeof(hdr));
+		len = ntohl(hdr.len);
+		if( len > MAX_PAYLOAD )
+		{
+			die_error("invalid frame in shared memory");
+		}
+		shm_copy_out(ring, tail + sizeof(hdr), link->frame, len);
+		link->frame[len] = '\0';
+		tail += sizeof(hdr) + len;
+		// give the space back before printing, the server can already reuse it
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+		handle_frame(sess, &hdr, link->frame);
+	}
+	
+	dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	if( dropped != link->dropped )
+	{
+		fprintf(stderr, "Info: %u messages lost, the shared memory ring was full\n", dropped - link->dropped);
+		link->dropped = dropped;
+	}
 	
-	int bytes_recvd = recv_message(client_sock, names_buffer, names_buffer_len);
-	if( bytes_recvd == -1 )
+	return;
+}
+
+void shm_close(shm_link *link)
+{
+	if( link->ring == NULL )
 	{
-		die_error("recv clients list");
+		return;
 	}
-	fprintf(stderr, "LIST OF CLIENTS\n%s", names_buffer);
+	munmap(link->ring, link->map_len);
+	close(link->efd);
+	free(link->frame);
+	link->ring = NULL;
 	
 	return;
 }
 
+/*
+ * connect, introduce ourselves (presenting the session token if we have one) and set up the transport
+ * return value: 0 on success, -1 if the server could not be reached
+*/
+int client_connect(client_info *ci, session *sess, shm_link *shm)
+{
+	memset(shm, 0, sizeof(shm_link));
+	if( client_create_socket_and_connect(ci) == -1 )
+	{
+		return -1;
+	}
+	sess->connected_at = monotonic_ns();
+	if( send_client_info(ci, sess) == -1 || ((ci->caps & CAP_SHM) && shm_accept(ci->sock, shm) == -1) )
+	{
+		close(ci->sock);
+		ci->sock = -1;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * the connection was lost: try again with an exponential backoff and full jitter so that
+ * every client dropped by the same network blip does not come back at the same moment
+ * return value: 0 once reconnected, -1 if the server stayed out of reach
+*/
+int client_reconnect(client_info *ci, session *sess, shm_link *shm)
+{
+	long ceiling = RECONNECT_BASE_MS, delay;
+	struct timespec pause;
+	int attempt;
+	
+	for( attempt = 0; attempt < RECONNECT_TRIES; ++attempt )
+	{
+		delay = random() % (ceiling + 1);
+		pause.tv_sec = delay / 1000;
+		pause.tv_nsec = (delay % 1000) * 1000000;
+		fprintf(stderr, "Info: connection lost, retrying in %ld ms\n", delay);
+		fflush(stderr);
+		nanosleep(&pause, NULL);
+		
+		if( client_connect(ci, sess, shm) == 0 )
+		{
+			return 0;
+		}
+		
+		ceiling *= 2;
+		if( ceiling > RECONNECT_MAX_MS )
+		{
+			ceiling = RECONNECT_MAX_MS;
+		}
+	}
+	
+	return -1;
+}
+
 void client_loop(client_info *c_info)
 {
-	client_info ci = *(fill_client_info(SERVER, c_info->port, c_info->pseudo, c_info->type, c_info->status));
-	client_create_socket_and_connect(&ci);
+	client_info ci;
 	
-	send_client_info(&ci);
+	fill_client_info(&ci, SERVER, c_info->port, c_info->pseudo, c_info->type, c_info->status);
+	ci.unix_path = c_info->unix_path;
+	ci.caps = c_info->caps;
+	
+	session sess;
+	shm_link shm;
+	uint64_t input;
+	memset(&sess, 0, sizeof(sess));
+	sess.pseudo = ci.pseudo;
+	
+	if( client_connect(&ci, &sess, &shm) == -1 )
+	{
+		exit(-1);
+	}
+	fprintf(stderr, "%s\n", CONNECTION_ESTABLISHED);
+	srandom(time(NULL) ^ getpid());
+	// a burst of messages is printed with a few writes, flushed before waiting
+	setvbuf(stderr, NULL, _IOFBF, OUT_BUFF);
 	
 	fd_set readfds;
-	int state;
+	int state, maxfd;
 	
-	char msg_buf[MAX_BUFF];
-	char recv_buf[MAX_BUFF];
+	// room for the pseudo prefix and a full payload
+	char *msg_buf = malloc(MAX_PAYLOAD + PSEUDO_LEN + 3);
 	int str_ptr, len;
 	
-	int bytes_recvd;
+	client_rx rx;
+	memset(&rx, 0, sizeof(rx));
 	
-	char *clients_list = NULL;
+	if( msg_buf == NULL )
+	{
+		die_error("message buffer");
+	}
 	
 	while( 1 )
 	{
 		FD_ZERO(&readfds);
 		FD_SET(STDIN_FILENO, &readfds);					// standard input
 		FD_SET(ci.sock, &readfds);						// send/recv socket of client
+		maxfd = ci.sock;
+		if( shm.ring != NULL )
+		{
+			// announce we are about to sleep, then look at the ring one last time: either
+			// we see what the server just wrote or the server sees the flag and wakes us up
+			atomic_store_explicit(&shm.ring->waiting, 1, memory_order_seq_cst);
+			shm_drain(&shm, &sess);
+			FD_SET(shm.efd, &readfds);
+			if( shm.efd > maxfd )
+			{
+				maxfd = shm.efd;
+			}
+		}
 		
-		state = select(ci.sock + 1, &readfds, NULL, NULL, NULL);
+		fflush(stderr);
+		state = select(maxfd + 1, &readfds, NULL, NULL, NULL);
 		if( state == -1 )
 		{
 			die_error("select");
 		}
 		
+		if( shm.ring != NULL && FD_ISSET(shm.efd, &readfds) )
+		{
+			uint64_t wakeups;
+			if( read(shm.efd, &wakeups, sizeof(wakeups)) == -1 )
+			{
+				die_error("eventfd");
+			}
+			shm_drain(&shm, &sess);
+		}
+		
 		if( FD_ISSET(STDIN_FILENO, &readfds) )
 		{
 			// enter detected - sending a message
 			// empty the buffer
-			memset(&msg_buf, 0, MAX_BUFF);
+			memset(msg_buf, 0, MAX_PAYLOAD + PSEUDO_LEN + 3);
 			// get pseudo len
 			str_ptr = 0;
 			len = strlen(ci.pseudo);
@@ -133,6 +705,13 @@ void client_loop(client_info *c_info)
 			str_ptr += 2;
 			// now msg contains - "pseudo: "
 			fgets(msg_buf + str_ptr, MAX_BUFF, stdin);
+			input = monotonic_ns();
+			if( msg_buf[str_ptr] == '\0' )
+			{
+				// end of input, leave like /quit
+				send_message(ci.sock, QUIT);
+				break;
+			}
 			len = strlen(msg_buf) - 1;
 			// remove newline added by fgets
 			msg_buf[len] = '\0';
@@ -152,14 +731,34 @@ void client_loop(client_info *c_info)
 					}
 					else if( !strncmp(msg_buf + str_ptr, QUIT, len) )
 					{
+						// tell the server we leave on purpose, it would keep our session otherwise
+						send_message(ci.sock, QUIT);
 						fprintf(stderr, "Goodbye %s\n", ci.pseudo);
 						break;
 					}
 					else if( !strncmp(msg_buf + str_ptr, LIST, len) )
 					{
-						// show list of connected users
+						// show list of connected users, the answer is printed when it arrives
+						send_message(ci.sock, msg_buf + str_ptr);
+					}
+					else if( !strncmp(msg_buf + str_ptr, PASTE, len) )
+					{
+						// several lines sent as a single (possibly large) message
+						len = read_paste(msg_buf, str_ptr, MAX_PAYLOAD);
+						if( len > str_ptr && ci.status != INVISIBLE )
+						{
+							send_chat(ci.sock, msg_buf, len, input);
+						}
+					}
+					else if( !strncmp(msg_buf + str_ptr, TRACE, len) )
+					{
+						// the server side of the latency breakdown, ours is printed when leaving
+						send_message(ci.sock, msg_buf + str_ptr);
+					}
+					else if( !strncmp(msg_buf + str_ptr, SEARCH, strlen(SEARCH)) )
+					{
+						// search the history, the answer is printed when it arrives
 						send_message(ci.sock, msg_buf + str_ptr);
-						recv_list_of_clients(ci.sock);
 					}
 					else if( !strncmp(msg_buf + str_ptr, KICK, strlen(KICK)) )
 					{
@@ -194,7 +793,7 @@ void client_loop(client_info *c_info)
 				{
 					if( ci.status != INVISIBLE )
 					{
-						send_message(ci.sock, msg_buf);
+						send_chat(ci.sock, msg_buf, strlen(msg_buf), input);
 					}
 				}
 			}
@@ -203,46 +802,545 @@ void client_loop(client_info *c_info)
 		if( FD_ISSET(ci.sock, &readfds) )
 		{
 			// ready to read from socket
-			memset(&recv_buf, 0, MAX_BUFF);
-			bytes_recvd = recv_message(ci.sock, recv_buf, MAX_BUFF);
-			if( bytes_recvd <= 0 )
+			if( recv_frames(ci.sock, &rx, &sess) <= 0 )
 			{
-				break;
+				if( shm.ring != NULL )
+				{
+					// the last messages (kicked out, ..) may still be in the ring
+					shm_drain(&shm, &sess);
+				}
+				if( sess.kicked )
+				{
+					break;
+				}
+				
+				shm_close(&shm);
+				close(ci.sock);
+				// whatever was left of a frame belonged to the old connection
+				rx.len = 0;
+				if( client_reconnect(&ci, &sess, &shm) == -1 )
+				{
+					fprintf(stderr, "%s\n", SERVER_CLOSE_MESSAGE);
+					break;
+				}
 			}
-			fprintf(stderr, "%s\n", recv_buf);
 		}
 	}
 	
-	close(ci.sock);
+	shm_close(&shm);
+	if( ci.sock != -1 )
+	{
+		close(ci.sock);
+	}
+	if( trace_out != NULL )
+	{
+		stage_report(msg_buf, MAX_PAYLOAD);
+		fprintf(stderr, "Traced messages received\n%s\n", msg_buf);
+	}
+	if( inflater.wire > 0 )
+	{
+		fprintf(stderr, "Info: %lu compressed bytes received for %lu bytes of messages\n", (unsigned long)inflater.wire, (unsigned long)inflater.inflated);
+	}
+	free(rx.buf);
+	free(msg_buf);
 	
 	return;
 }
 
-/********************************
- ********************************
- * main function				*
- ********************************
-/*****************************/
-int main(int argc, char *argv[])
+/*
+ * queue a frame on a headless session, it goes out with everything else queued
+ * for the session in the same loop iteration
+*/
+void bot_queue(bot *b, frame_type type, const char *payload, size_t len, const trace_stamps *tr)
 {
-	if( argc != 5 )
+	size_t head_len = (tr != NULL) ? sizeof(trace_stamps) : 0;
+	frame_hdr hdr = { htonl(head_len + len), htonl(tr != NULL ? FRAME_TRACED : type), 0 };
+	size_t need = b->tx_len + sizeof(hdr) + head_len + len;
+	
+	if( need > b->tx_cap )
 	{
-		fprintf(stderr, "usage: %s [port] [pseudo] [usertype] [userstatus]\n", argv[0]);
-		exit(-1);
+		size_t cap = (b->tx_cap == 0) ? MAX_BUFF : b->tx_cap;
+		while( cap < need )
+		{
+			cap *= 2;
+		}
+		char *grown = realloc(b->tx, cap);
+		if( grown == NULL )
+		{
+			die_error("send buffer");
+		}
+		b->tx = grown;
+		b->tx_cap = cap;
+	}
+	memcpy(b->tx + b->tx_len, &hdr, sizeof(hdr));
+	memcpy(b->tx + b->tx_len + sizeof(hdr), tr, head_len);
+	memcpy(b->tx + b->tx_len + sizeof(hdr) + head_len, payload, len);
+	b->tx_len = need;
+	b->sent += 1;
+	
+	return;
+}
+
+/*
+ * turn a line of the script into what the interactive client would have sent
+ * msg_buf: room for the pseudo prefix and a full payload
+ * input: when the line was read, chat messages queued now carry it in trace mode
+*/
+void bot_command(bot *b, const char *text, char *msg_buf, uint64_t input)
+{
+	trace_stamps tr;
+	int len;
+	
+	if( b->ci.sock == -1 || b->quitting )
+	{
+		return;
+	}
+	
+	if( !strcmp(text, QUIT) )
+	{
+		bot_queue(b, FRAME_TEXT, QUIT, strlen(QUIT), NULL);
+		b->quitting = 1;
+		return;
+	}
+	if( !strcmp(text, LIST) || !strncmp(text, KICK, strlen(KICK)) || !strncmp(text, SEARCH, strlen(SEARCH)) || !strcmp(text, TRACE) )
+	{
+		bot_queue(b, FRAME_TEXT, text, strlen(text), NULL);
+		return;
+	}
+	if( !strncmp(text, CHANGE, strlen(CHANGE)) )
+	{
+		memset(b->ci.pseudo, '\0', PSEUDO_LEN);
+		strncpy(b->ci.pseudo, text + strlen(CHANGE) + 1, PSEUDO_LEN - 1);
+		bot_queue(b, FRAME_TEXT, text, strlen(text), NULL);
+		return;
+	}
+	
+	if( text[0] == '@' )
+	{
+		len = snprintf(msg_buf, MAX_PAYLOAD, "%s - private from %s", text, b->ci.pseudo);
+	}
+	else if( b->ci.status != INVISIBLE )
+	{
+		len = snprintf(msg_buf, MAX_PAYLOAD, "%s: %s", b->ci.pseudo, text);
+	}
+	else
+	{
+		return;
+	}
+	if( len >= MAX_PAYLOAD - (int)sizeof(tr) )
+	{
+		len = MAX_PAYLOAD - sizeof(tr) - 1;
+	}
+	if( trace_out != NULL && text[0] != '@' )
+	{
+		// stamped when queued, the time spent waiting for the batch to go out counts as uplink
+		trace_stamp(&tr, input);
+		bot_queue(b, FRAME_TEXT, msg_buf, len, &tr);
+	}
+	else
+	{
+		bot_queue(b, FRAME_TEXT, msg_buf, len, NULL);
 	}
 	
+	return;
+}
+
+/*
+ * a script line is "<session> <text>", session being a number from 1 to the number
+ * of sessions or * for all of them
+*/
+void script_line(bot *bots, int nb_bots, char *line, char *msg_buf, uint64_t input)
+{
+	size_t len = strlen(line);
+	char *text, *end;
+	long target;
+	int i;
+	
+	if( len > 0 && line[len - 1] == '\r' )
+	{
+		line[len - 1] = '\0';
+	}
+	if( line[0] == '\0' || line[0] == '#' )
+	{
+		return;
+	}
+	
+	text = strchr(line, ' ');
+	if( text == NULL )
+	{
+		fprintf(stderr, "Info: script line without a message: %s\n", line);
+		return;
+	}
+	*text++ = '\0';
+	
+	if( !strcmp(line, "*") )
+	{
+		for( i = 0; i < nb_bots; ++i )
+		{
+			bot_command(&bots[i], text, msg_buf, input);
+		}
+		return;
+	}
+	
+	target = strtol(line, &end, 10);
+	if( *end != '\0' || target < 1 || target > nb_bots )
+	{
+		fprintf(stderr, "Info: unknown session in script: %s\n", line);
+		return;
+	}
+	bot_command(&bots[target - 1], text, msg_buf, input);
+	
+	return;
+}
+
+/*
+ * write what is queued for a session, as much as the socket takes without blocking
+ * return value: 0, -1 if the connection is gone
+*/
+int bot_flush(bot *b)
+{
+	ssize_t bytes_sent;
+	
+	if( b->tx_off == b->tx_len )
+	{
+		return 0;
+	}
+	
+	bytes_sent = send(b->ci.sock, b->tx + b->tx_off, b->tx_len - b->tx_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if( bytes_sent == -1 )
+	{
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+	b->tx_off += bytes_sent;
+	if( b->tx_off == b->tx_len )
+	{
+		b->tx_off = 0;
+		b->tx_len = 0;
+	}
+	
+	return 0;
+}
+
+void bot_close(bot *b)
+{
+	close(b->ci.sock);
+	b->ci.sock = -1;
+	if( b->tx_len > b->tx_off )
+	{
+		fprintf(stderr, "Info: %s lost %zu unsent bytes\n", b->ci.pseudo, b->tx_len - b->tx_off);
+	}
+	
+	return;
+}
+
+/*
+ * non interactive client: runs nb_bots sessions on one event loop, reads what they
+ * say from a script and writes everything they receive to stdout as records
+ * script_path: file to read the script from, - for stdin
+ * linger: seconds the sessions keep receiving after the end of the script before they /quit
+*/
+void headless_loop(client_info *c_info, const char *script_path, int nb_bots, int linger)
+{
+	bot *bots = calloc(nb_bots, sizeof(bot));
+	char *script = malloc(SCRIPT_BUFF + 1);
+	char *msg_buf = malloc(MAX_PAYLOAD + PSEUDO_LEN + 3);
+	size_t script_len = 0;
+	int script_fd, i, live, maxfd, state, quit_sent = 0;
+	struct timespec quit_at, now;
+	struct timeval timeout;
+	fd_set readfds, writefds;
+	char *line, *eol;
+	
+	if( bots == NULL || script == NULL || msg_buf == NULL )
+	{
+		die_error("headless buffers");
+	}
+	
+	script_fd = strcmp(script_path, "-") ? open(script_path, O_RDONLY) : STDIN_FILENO;
+	if( script_fd == -1 )
+	{
+		die_error("script");
+	}
+	
+	// records go out in large writes instead of one write per message
+	setvbuf(stdout, NULL, _IOFBF, OUT_BUFF);
+	
+	for( i = 0; i < nb_bots; ++i )
+	{
+		bot *b = &bots[i];
+		shm_link unused;
+		
+		fill_client_info(&b->ci, SERVER, c_info->port, c_info->pseudo, c_info->type, c_info->status);
+		b->ci.unix_path = c_info->unix_path;
+		b->ci.caps = c_info->caps;
+		if( nb_bots > 1 )
+		{
+			// bot1, bot2, .. cut so that the number always fits
+			char number[12];
+			int digits = snprintf(number, sizeof(number), "%d", i + 1);
+			b->ci.pseudo[PSEUDO_LEN - 1 - digits] = '\0';
+			strcat(b->ci.pseudo, number);
+		}
+		b->sess.record = b->ci.pseudo;
+		b->sess.pseudo = b->ci.pseudo;
+		
+		if( client_connect(&b->ci, &b->sess, &unused) == -1 )
+		{
+			exit(-1);
+		}
+		if( b->ci.sock >= FD_SETSIZE )
+		{
+			fprintf(stderr, "too many sessions for select, started %d\n", i);
+			exit(-1);
+		}
+	}
+	fprintf(stderr, "%s: %d sessions\n", CONNECTION_ESTABLISHED, nb_bots);
+	
+	live = nb_bots;
+	while( live > 0 )
+	{
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		maxfd = -1;
+		
+		// stop reading the script while a session cannot keep up
+		int backlog = 0;
+		for( i = 0; i < nb_bots; ++i )
+		{
+			if( bots[i].ci.sock == -1 )
+			{
+				continue;
+			}
+			FD_SET(bots[i].ci.sock, &readfds);
+			if( bots[i].tx_len > bots[i].tx_off )
+			{
+				FD_SET(bots[i].ci.sock, &writefds);
+			}
+			if( bots[i].tx_len - bots[i].tx_off > TX_HIGH_WATER )
+			{
+				backlog = 1;
+			}
+			if( bots[i].ci.sock > maxfd )
+			{
+				maxfd = bots[i].ci.sock;
+			}
+		}
+		if( script_fd != -1 && !backlog )
+		{
+			FD_SET(script_fd, &readfds);
+			if( script_fd > maxfd )
+			{
+				maxfd = script_fd;
+			}
+		}
+		
+		fflush(stdout);
+		state = select(maxfd + 1, &readfds, &writefds, NULL, (script_fd == -1 && !quit_sent) ? &timeout : NULL);
+		if( state == -1 )
+		{
+			die_error("select");
+		}
+		
+		if( script_fd != -1 && FD_ISSET(script_fd, &readfds) )
+		{
+			ssize_t bytes_read = read(script_fd, script + script_len, SCRIPT_BUFF - script_len);
+			if( bytes_read == -1 )
+			{
+				die_error("script");
+			}
+			uint64_t read_at = monotonic_ns();
+			script_len += bytes_read;
+			script[script_len] = '\0';
+			
+			line = script;
+			while( (eol = memchr(line, '\n', script_len - (line - script))) != NULL )
+			{
+				*eol = '\0';
+				script_line(bots, nb_bots, line, msg_buf, read_at);
+				line = eol + 1;
+			}
+			script_len -= line - script;
+			memmove(script, line, script_len);
+			
+			if( bytes_read == 0 || script_len == SCRIPT_BUFF )
+			{
+				// last line without a newline, or a line longer than the buffer
+				script[script_len] = '\0';
+				script_line(bots, nb_bots, script, msg_buf, read_at);
+				script_len = 0;
+			}
+			if( bytes_read == 0 )
+			{
+				// end of the script: every session leaves after lingering a bit
+				if( script_fd != STDIN_FILENO )
+				{
+					close(script_fd);
+				}
+				script_fd = -1;
+				clock_gettime(CLOCK_MONOTONIC, &quit_at);
+				quit_at.tv_sec += linger;
+			}
+		}
+		
+		if( script_fd == -1 && !quit_sent )
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if( now.tv_sec > quit_at.tv_sec || (now.tv_sec == quit_at.tv_sec && now.tv_nsec >= quit_at.tv_nsec) )
+			{
+				for( i = 0; i < nb_bots; ++i )
+				{
+					bot_command(&bots[i], QUIT, msg_buf, 0);
+				}
+				quit_sent = 1;
+			}
+			else
+			{
+				timeout.tv_sec = quit_at.tv_sec - now.tv_sec;
+				timeout.tv_usec = (quit_at.tv_nsec - now.tv_nsec) / 1000;
+				if( timeout.tv_usec < 0 )
+				{
+					timeout.tv_sec -= 1;
+					timeout.tv_usec += 1000000;
+				}
+			}
+		}
+		
+		for( i = 0; i < nb_bots; ++i )
+		{
+			bot *b = &bots[i];
+			
+			if( b->ci.sock == -1 )
+			{
+				continue;
+			}
+			// a session is done when the server closes it: after /quit, a kick or a drop
+			if( (FD_ISSET(b->ci.sock, &readfds) && recv_frames(b->ci.sock, &b->rx, &b->sess) <= 0) || bot_flush(b) == -1 )
+			{
+				bot_close(b);
+				live -= 1;
+			}
+		}
+	}
+	
+	// one record per session: frames it sent and records written for it
+	for( i = 0; i < nb_bots; ++i )
+	{
+		printf("%s\tstats\t0\tsent=%lu delivered=%lu%s\n", bots[i].ci.pseudo, bots[i].sent,
+				bots[i].sess.delivered, bots[i].sess.kicked ? " kicked" : "");
+		free(bots[i].rx.buf);
+		free(bots[i].tx);
+	}
+	if( trace_out != NULL )
+	{
+		// breakdown over every session of the process
+		stage_report(msg_buf, MAX_PAYLOAD);
+		write_record("*", "trace", 0, msg_buf);
+	}
+	if( inflater.wire > 0 )
+	{
+		printf("*\tcompression\t0\twire=%lu inflated=%lu\n", (unsigned long)inflater.wire, (unsigned long)inflater.inflated);
+	}
+	fflush(stdout);
+	
+	free(bots);
+	free(script);
+	free(msg_buf);
+	
+	return;
+}
+
+/********************************
+ ********************************
+ * main function				*
+ ********************************
+/*****************************/
+int main(int argc, char *argv[])
+{
 	client_info ci;
+	char *script = NULL;
+	int opt, nb_sessions = 1, linger = 0;
+	
+	memset(&ci, 0, sizeof(ci));
+	while( (opt = getopt(argc, argv, "u:sH:n:w:t:c")) != -1 )
+	{
+		switch( opt )
+		{
+			case 'H':
+				script = optarg;
+				break;
+			case 'n':
+				nb_sessions = atoi(optarg);
+				break;
+			case 'w':
+				linger = atoi(optarg);
+				break;
+			case 'c':
+				ci.caps |= CAP_DEFLATE;
+				if( inflateInit2(&inflater.zs, -15) != Z_OK )
+				{
+					die_error("inflate init");
+				}
+				inflater.dict_id = adler32(adler32(0, NULL, 0), (const Bytef *)compress_dict, sizeof(compress_dict) - 1);
+				break;
+			case 't':
+				trace_out = fopen(optarg, "w");
+				if( trace_out == NULL )
+				{
+					die_error("trace file");
+				}
+				// one line per delivery, written in large chunks
+				setvbuf(trace_out, NULL, _IOFBF, OUT_BUFF);
+				fprintf(trace_out, "id,receiver,input,send,recv,dispatch,enqueue,deliver\n");
+				break;
+			case 'u':
+				ci.unix_path = optarg;
+				break;
+			case 's':
+				ci.caps |= CAP_SHM;
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	
+	// the port is not needed when connecting to the unix socket
+	int positional = (ci.unix_path != NULL) ? 3 : 4;
+	if( argc - optind != positional || ((ci.caps & CAP_SHM) && (ci.unix_path == NULL || script != NULL))
+		|| nb_sessions < 1 || nb_sessions > MAX_SESSIONS || (nb_sessions > 1 && script == NULL) )
+	{
+		fprintf(stderr, "usage: %s [-t trace file] [-c] [port] [pseudo] [usertype] [userstatus]\n", argv[0]);
+		fprintf(stderr, "       %s -u [unix socket path] [-s] [-t trace file] [-c] [pseudo] [usertype] [userstatus]\n", argv[0]);
+		fprintf(stderr, "       %s -H [script] [-n sessions] [-w linger] [-t trace file] [-c] [port] [pseudo] [usertype] [userstatus]\n", argv[0]);
+		fprintf(stderr, "       %s -H [script] [-n sessions] [-w linger] [-t trace file] [-c] -u [unix socket path] [pseudo] [usertype] [userstatus]\n", argv[0]);
+		fprintf(stderr, "       -s: receive through shared memory (local clients only)\n");
+		fprintf(stderr, "       -H: no terminal, run the script (- for stdin) and write what is received to stdout\n");
+		fprintf(stderr, "       -n: number of sessions in headless mode, up to %d\n", MAX_SESSIONS);
+		fprintf(stderr, "       -w: seconds to keep receiving after the end of the script\n");
+		fprintf(stderr, "       -t: trace chat messages, write the stamps of the traced ones received to this file\n");
+		fprintf(stderr, "       -c: ask the server to compress what it sends\n");
+		exit(-1);
+	}
+	char **args = argv + optind;
 	
-	memset(ci.port, 0, sizeof(ci.port));
-	strncpy(ci.port, argv[1], 4);
+	if( ci.unix_path == NULL )
+	{
+		strncpy(ci.port, *args++, 4);
+	}
 	
-	memset(ci.pseudo, 0, sizeof(ci.pseudo));
-	strncpy(ci.pseudo, argv[2], sizeof(ci.pseudo));
+	strncpy(ci.pseudo, args[0], sizeof(ci.pseudo));
 	
-	ci.type = atoi(argv[3]);
-	ci.status = atoi(argv[4]);
+	ci.type = atoi(args[1]);
+	ci.status = atoi(args[2]);
 	
-	client_loop(&ci);
+	if( script != NULL )
+	{
+		headless_loop(&ci, script, nb_sessions, linger);
+	}
+	else
+	{
+		client_loop(&ci);
+	}
 	
 	return 0;
 }
@@ -256,49 +1354,176 @@ void die_error(const char *msg)
 	exit(-1);
 }
 
-int send_client_info(client_info *ci)
+/*
+ * return value: bytes sent by the last send, -1 if the connection failed
+*/
+int send_client_info(client_info *ci, session *sess)
 {
-	// send pseudo
-	int bytes_sent = send(ci->sock, ci->pseudo, strlen(ci->pseudo), 0);
+	// send pseudo, always PSEUDO_LEN bytes so the server knows where the type starts
+	int bytes_sent = send(ci->sock, ci->pseudo, PSEUDO_LEN, 0);
 	if( bytes_sent <= 0 )
 	{
-		die_error("send client info - pseudo");
+		perror("send client info - pseudo");
+		return -1;
 	}
 	
 	// send type
 	bytes_sent = send(ci->sock, &(ci->type), sizeof(ci->type), 0);
 	if( bytes_sent <= 0 )
 	{
-		die_error("send client info - type");
+		perror("send client info - type");
+		return -1;
 	}
 	
 	// send status
 	bytes_sent = send(ci->sock, &(ci->status), sizeof(ci->status), 0);
 	if( bytes_sent <= 0 )
 	{
-		die_error("send client info - status");
+		perror("send client info - status");
+		return -1;
 	}
 	
-	fprintf(stderr, "%s\n", CONNECTION_ESTABLISHED);
+	// send the transports we would like to use
+	uint32_t caps = htonl(ci->caps);
+	bytes_sent = send(ci->sock, &caps, sizeof(caps), 0);
+	if( bytes_sent <= 0 )
+	{
+		perror("send client info - caps");
+		return -1;
+	}
+	
+	// the dictionary compressed frames must be made with, 0 when we did not ask for compression
+	uint32_t dict_id = htonl(inflater.dict_id);
+	bytes_sent = send(ci->sock, &dict_id, sizeof(dict_id), 0);
+	if( bytes_sent <= 0 )
+	{
+		perror("send client info - dictionary");
+		return -1;
+	}
+	
+	// send the session to resume, all zero the first time, and the last message we saw
+	bytes_sent = send(ci->sock, sess->token, TOKEN_LEN, 0);
+	if( bytes_sent <= 0 )
+	{
+		perror("send client info - token");
+		return -1;
+	}
+	uint64_t last_seq = htobe64(sess->last_seq);
+	bytes_sent = send(ci->sock, &last_seq, sizeof(last_seq), 0);
+	if( bytes_sent <= 0 )
+	{
+		perror("send client info - sequence");
+		return -1;
+	}
 	
 	return bytes_sent;
 }
 
+void send_frame(int sock, frame_type type, const char *payload, size_t len)
+{
+	send_frame_parts(sock, type, NULL, 0, payload, len);
+	
+	return;
+}
+
+// send a frame whose payload is head followed by payload, without copying them together
+void send_frame_parts(int sock, frame_type type, const char *head, size_t head_len, const char *payload, size_t len)
+{
+	frame_hdr hdr = { htonl(head_len + len), htonl(type), 0 };
+	struct iovec iov[3] = { { &hdr, sizeof(hdr) }, { (void *)head, head_len }, { (void *)payload, len } };
+	struct msghdr msg;
+	ssize_t bytes_sent;
+	
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	while( msg.msg_iovlen > 0 )
+	{
+		bytes_sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if( bytes_sent == -1 )
+		{
+			// the connection is gone, the receive side notices it and reconnects
+			perror("send message");
+			return;
+		}
+		// short send, skip what already went out
+		while( msg.msg_iovlen > 0 && (size_t)bytes_sent >= msg.msg_iov->iov_len )
+		{
+			bytes_sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if( msg.msg_iovlen > 0 )
+		{
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + bytes_sent;
+			msg.msg_iov->iov_len -= bytes_sent;
+		}
+	}
+	
+	return;
+}
+
 void send_message(int sock, const char *msg)
 {
-	int bytes_sent = send(sock, msg, strlen(msg), 0);
-	if( bytes_sent == -1 )
+	send_frame(sock, FRAME_TEXT, msg, strlen(msg));
+	
+	return;
+}
+
+/*
+ * send a chat message, in trace mode with its stamps in front of the text
+ * input: when the line was read, CLOCK_MONOTONIC nanoseconds
+*/
+void send_chat(int sock, const char *msg, size_t len, uint64_t input)
+{
+	trace_stamps tr;
+	
+	if( trace_out == NULL )
+	{
+		send_frame(sock, FRAME_TEXT, msg, len);
+		return;
+	}
+	if( len > MAX_PAYLOAD - sizeof(tr) )
 	{
-		die_error("send message");
+		len = MAX_PAYLOAD - sizeof(tr);
 	}
+	trace_stamp(&tr, input);
+	send_frame_parts(sock, FRAME_TRACED, (const char *)&tr, sizeof(tr), msg, len);
 	
 	return;
 }
 
-void client_create_socket_and_connect(client_info *ci)
+/*
+ * return value: 0 once connected, -1 if the server could not be reached
+*/
+int client_create_socket_and_connect(client_info *ci)
 {
 	struct addrinfo *addrinfo = NULL, hints;
 	
+	if( ci->unix_path != NULL )
+	{
+		struct sockaddr_un addr;
+		
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, ci->unix_path, sizeof(addr.sun_path) - 1);
+		
+		ci->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if( ci->sock == -1 )
+		{
+			die_error("socket error");
+		}
+		if( connect(ci->sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 )
+		{
+			perror("connect error");
+			close(ci->sock);
+			ci->sock = -1;
+			return -1;
+		}
+		
+		return 0;
+	}
+	
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_STREAM;
@@ -319,33 +1544,130 @@ void client_create_socket_and_connect(client_info *ci)
 	
 	// attempt to connect
 	state = connect(ci->sock, addrinfo->ai_addr, addrinfo->ai_addrlen);
+	freeaddrinfo(addrinfo);
 	if( state == -1 )
 	{
-		die_error("connect error");
+		perror("connect error");
+		close(ci->sock);
+		ci->sock = -1;
+		return -1;
 	}
 	
-	return;
+	return 0;
 }
 
-int recv_message(int sock, char *out_buffer, int buffer_len)
+/*
+ * read what the server sent and print every complete frame
+ * return value: bytes received, 0 if the server closed the connection, -1 on error
+*/
+int recv_frames(int sock, client_rx *rx, session *sess)
 {
-	return recv(sock, out_buffer, buffer_len, 0);
+	frame_hdr hdr;
+	size_t done = 0, len, need;
+	
+	if( rx->buf == NULL )
+	{
+		rx->cap = sizeof(frame_hdr) + MAX_BUFF;
+		rx->buf = malloc(rx->cap + 1);
+		if( rx->buf == NULL )
+		{
+			die_error("receive buffer");
+		}
+	}
+	
+	int bytes_recvd = recv(sock, rx->buf + rx->len, rx->cap - rx->len, 0);
+	if( bytes_recvd <= 0 )
+	{
+		return bytes_recvd;
+	}
+	rx->len += bytes_recvd;
+	
+	while( rx->len - done >= sizeof(frame_hdr) )
+	{
+		memcpy(&hdr, rx->buf + done, sizeof(hdr));
+		len = ntohl(hdr.len);
+		if( len > MAX_PAYLOAD )
+		{
+			fprintf(stderr, "Info: invalid message from the server\n");
+			return -1;
+		}
+		
+		need = sizeof(frame_hdr) + len;
+		if( rx->len - done < need )
+		{
+			if( rx->cap < need )
+			{
+				char *grown = realloc(rx->buf, need + 1);
+				if( grown == NULL )
+				{
+					die_error("receive buffer");
+				}
+				rx->buf = grown;
+				rx->cap = need;
+			}
+			break;
+		}
+		
+		char *payload = rx->buf + done + sizeof(frame_hdr);
+		char saved = payload[len];
+		payload[len] = '\0';
+		handle_frame(sess, &hdr, payload);
+		payload[len] = saved;
+		done += need;
+	}
+	
+	// keep the incomplete frame at the front of the buffer
+	memmove(rx->buf, rx->buf + done, rx->len - done);
+	rx->len -= done;
+	
+	return bytes_recvd;
 }
 
-client_info *fill_client_info(char *ip, char *port, char *pseudo, client_type type, client_status status)
+void fill_client_info(client_info *ci, char *ip, char *port, char *pseudo, client_type type, client_status status)
 {
-	client_info *ci = malloc(sizeof(client_info));
-	
+	memset(ci, 0, sizeof(client_info));
 	ci->sock = -1;
 	
-	strncpy(ci->ip, ip, strlen(ip));
-	strncpy(ci->port, port, strlen(port));
-	strncpy(ci->pseudo, pseudo, strlen(pseudo));
+	strncpy(ci->ip, ip, sizeof(ci->ip) - 1);
+	strncpy(ci->port, port, sizeof(ci->port) - 1);
+	strncpy(ci->pseudo, pseudo, sizeof(ci->pseudo) - 1);
 	
 	ci->type = type;
 	ci->status = status;
 	
-	return ci;
+	return;
+}
+
+/*
+ * headless mode: one line per frame on stdout, "pseudo<tab>kind<tab>sequence<tab>payload",
+ * with backslashes, tabs and newlines escaped so that a record always fits on its line
+*/
+void write_record(const char *pseudo, const char *kind, uint64_t seq, const char *payload)
+{
+	const char *c;
+	
+	printf("%s\t%s\t%llu\t", pseudo, kind, (unsigned long long)seq);
+	for( c = payload; *c != '\0'; ++c )
+	{
+		switch( *c )
+		{
+			case '\\':
+				fputs("\\\\", stdout);
+				break;
+			case '\t':
+				fputs("\\t", stdout);
+				break;
+			case '\n':
+				fputs("\\n", stdout);
+				break;
+			default:
+				putchar_unlocked(*c);
+				break;
+		}
+	}
+	putchar_unlocked('\n');
+	
+	return;
 }
 
 void print_client_info(client_info *ci)
@@ -0,0 +1,107 @@
+/*
+ * latency histograms of the traced chat messages, shared by the server and the client
+*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_BUCKETS		40				// latency histograms, bucket b holds [2^b, 2^(b+1)[ nanoseconds
+
+typedef struct STAGE_STATS
+{
+	uint64_t count;
+	uint64_t sum;							// nanoseconds
+	uint64_t max;
+	uint64_t discarded;						// measures whose stamps made no sense
+	uint64_t buckets[TRACE_BUCKETS];
+} stage_stats;
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * add one measure (end - start, nanoseconds) to the statistics of a stage
+ * now: the current time, stamps are taken by other processes and can be anything
+ * return value: 0, -1 if the stamps are missing, out of order or in the future
+ * (the measure is only counted as discarded)
+*/
+static int stage_add(stage_stats *st, uint64_t start, uint64_t end, uint64_t now)
+{
+	uint64_t ns;
+	int bucket = 0;
+	
+	if( start == 0 || end < start || end > now )
+	{
+		st->discarded += 1;
+		return -1;
+	}
+	ns = end - start;
+	while( bucket < TRACE_BUCKETS - 1 && (ns >> (bucket + 1)) != 0 )
+	{
+		bucket++;
+	}
+	st->count += 1;
+	st->sum += ns;
+	if( ns > st->max )
+	{
+		st->max = ns;
+	}
+	st->buckets[bucket] += 1;
+	
+	return 0;
+}
+
+/*
+ * upper bound of the bucket holding the given fraction of the measures
+ * return value: microseconds, never above the largest measure
+*/
+static double stage_percentile(stage_stats *st, double fraction)
+{
+	uint64_t seen = 0, rank = st->count * fraction;
+	int bucket;
+	
+	for( bucket = 0; bucket < TRACE_BUCKETS - 1; ++bucket )
+	{
+		seen += st->buckets[bucket];
+		if( seen > rank )
+		{
+			break;
+		}
+	}
+	
+	// the top bucket is only partly filled
+	uint64_t bound = (uint64_t)2 << bucket;
+	
+	return (double)(bound < st->max ? bound : st->max) / 1000;
+}
+
+/*
+ * one csv line per stage after a header line starting with prefix
+ * return value: length written to out
+*/
+static int stage_format(char *out, size_t size, const char *prefix, const char **names, stage_stats *stats, int nb_stages)
+{
+	int used, s;
+	
+	used = snprintf(out, size, "%sstage,count,mean_us,p50_us,p99_us,max_us,discarded", prefix);
+	for( s = 0; s < nb_stages && (size_t)used < size; ++s )
+	{
+		stage_stats *st = &stats[s];
+		used += snprintf(out + used, size - used, "\n%s,%lu,%.1f,%.1f,%.1f,%.1f,%lu", names[s], (unsigned long)st->count,
+				st->count ? (double)st->sum / st->count / 1000 : 0.0, stage_percentile(st, 0.5), stage_percentile(st, 0.99),
+				(double)st->max / 1000, (unsigned long)st->discarded);
+	}
+	
+	return (size_t)used < size ? used : (int)size - 1;
+}
+
+#endif
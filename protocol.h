@@ -0,0 +1,102 @@
+/*
+ * what the server and the client say to each other, shared by both programs
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define PSEUDO_LEN			15
+#define MAX_PAYLOAD			65536			// largest message a single frame can carry
+#define TOKEN_LEN			16				// bytes of a session resumption token
+
+// transports a client can ask for during the handshake
+#define CAP_SHM				0x01			// shared memory ring for server to client traffic
+#define CAP_DEFLATE			0x02			// frames compressed with the shared dictionary
+
+typedef enum CLIENT_TYPE
+{
+	REGULAR, ADMINISTRATOR
+} client_type;
+
+typedef enum CLIENT_STATUS
+{
+	VISIBLE, INVISIBLE
+} client_status;
+
+// what a client sends when it connects: pseudo, type, status, caps, dictionary id, token and last sequence number
+#define HANDSHAKE_LEN		(PSEUDO_LEN + sizeof(client_type) + sizeof(client_status) + 2 * sizeof(uint32_t) + TOKEN_LEN + sizeof(uint64_t))
+
+// every message on the wire is a frame header followed by len bytes of payload
+typedef struct FRAME_HDR
+{
+	uint32_t len;							// network byte order
+	uint32_t type;							// network byte order
+	uint64_t seq;							// big endian, chat messages only, 0 otherwise
+} frame_hdr;
+
+typedef enum FRAME_TYPE
+{
+	FRAME_TEXT = 1,							// chat text, server notices and commands
+	FRAME_LIST,								// answer to /list
+	FRAME_SHM,								// answer to CAP_SHM: ring size, memfd and eventfd attached
+	FRAME_SESSION,							// resumption token and whether the session was resumed
+	FRAME_KICKED,							// last frame before the server closes, do not reconnect
+	FRAME_TRACED,							// chat text whose payload starts with a trace_stamps block
+	FRAME_DEFLATE							// whole frames compressed: dictionary id, their length, raw deflate
+} frame_type;
+
+/*
+ * stamped on a traced chat message as it goes through the chain, CLOCK_MONOTONIC
+ * nanoseconds in big endian: comparing stamps of two processes only makes sense on one host
+*/
+typedef struct TRACE_STAMPS
+{
+	uint64_t id;							// chosen by the sender, its pid in the high half and a counter in the low half
+	uint64_t input;							// sender read the line
+	uint64_t send;							// sender wrote the frame
+	uint64_t recv;							// server read the frame
+	uint64_t dispatch;						// server started handling it
+	uint64_t enqueue;						// server framed the broadcast, right before fan-out
+} trace_stamps;
+
+/*
+ * ring shared by a server and a client on the same host, the server writes whole frames
+ * and the client reads them; head and tail count bytes and wrap around freely
+ * the client can write anywhere in the mapping: the server only trusts its own
+ * copy of head and size and checks the tail it reads
+*/
+typedef struct SHM_RING
+{
+	_Alignas(64) _Atomic uint32_t head;		// only written by the server
+	_Alignas(64) _Atomic uint32_t tail;		// only written by the client
+	_Alignas(64) _Atomic uint32_t waiting;	// the client sleeps on the eventfd until woken
+	_Atomic uint32_t dropped;				// frames that did not fit
+	uint32_t size;							// for the client, never read back by the server
+	char data[];
+} shm_ring;
+
+/*
+ * preset dictionary of the compressor, both sides need the very same bytes: what the
+ * server says all the time and common words, the most frequent strings at the end
+ * its adler32 goes in the handshake and in every FRAME_DEFLATE, change it and they no longer match
+*/
+static const char compress_dict[] =
+	"You have been kicked out from the chat\n"
+	"Server: some messages were lost while you were away\n"
+	" has changed their pseudo to  - private from @"
+	"****************************************************************\n"
+	"*\tWelcome  - to the chat of Nantes University\t*\n"
+	"****************************************************************"
+	"what when where which while who why will with would your you yes no not now "
+	"just know like think good time well really thanks thank please sorry okay ok "
+	"here there this that they them then than these those have has had been being "
+	"about after again also because before could should from into over only some "
+	"the and for are but was were can did does don't it's i'm "
+	"] has left the chat"
+	"Server: ["
+	"] has joined the chat";
+
+#endif
@@ -2,6 +2,8 @@
  * Author : KANITA Nada
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -13,133 +15,2631 @@
 #include <sys/select.h>
 #include <strings.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <endian.h>
+#include <ctype.h>
+#include <zlib.h>
+
+#include "latency.h"
+#include "protocol.h"
 
 #define SERVER				"0.0.0.0"
 #define PORT				"6666"
 #define MAX_BUFF			512
-#define PSEUDO_LEN			15
-#define MAX_CLIENTS			12
+#define MAX_CLIENTS			512				// select() limits us to FD_SETSIZE descriptors anyway
+#define HISTORY_LEN			1024			// chat messages kept for resumed sessions, power of two
+#define JOIN_REPLAY			64				// chat messages replayed to clients that join
+#define RESUME_GRACE		60				// seconds a lost session waits for its client to come back
+#define HANDSHAKE_MAX		64				// visitors that have not sent their whole handshake yet
+#define HANDSHAKE_TIMEOUT	5				// seconds a visitor has to send it
+
+#define ZC_THRESHOLD		16384			// default size from which broadcasts use MSG_ZEROCOPY
+#define ZC_MAX_PENDING		64				// zerocopy sends in flight per client
+#define ZC_LINGER			10				// seconds a closed connection may wait for its zerocopy completions
+
+#define SHM_RING_SIZE		(1 << 20)		// bytes of frames in a shared memory ring, power of two
+
+#define INDEX_BUDGET_MB		64				// default memory of the search index
+#define INDEX_SEGMENT_LEN	16384			// chat messages per index segment, dropped as a whole
+#define INDEX_SEGMENT_SHARE	4				// a segment is also closed once it holds 1/4 of the budget
+#define INDEX_JOBS			4096			// messages and searches queued for the index thread, power of two
+#define INDEX_RETRY_NS		1000000			// index thread sleep while the answer queue is full
+#define TERM_MAX			32				// longer words are cut
+#define SEARCH_TERMS		8				// words of a search, the rest is ignored
+#define SEARCH_RESULTS		20				// newest matches sent back
+
+#define COMPRESS_MIN		128				// smaller frames are sent as they are
+#define COMPRESS_REPORT		1024			// compressed buffers between two reports in the log
+
+#define BENCH_SLOTS			100000			// detached slots of the table walked by the benchmark
+#define BENCH_WALKS			1000			// broadcasts to that table, only the walk is timed
+#define BENCH_EVICT			(64 << 20)		// bytes written between two cold walks to empty the caches
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY			60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY		0x4000000
+#endif
 
 #define LIST				"/list"
 #define KICK				"/kick"
 #define CHANGE				"/change"
+#define QUIT				"/quit"
+#define SEARCH				"/search"
+#define TRACE				"/trace"
+
+#define LOG_RING_SIZE		1024			// number of records, must be a power of two
+#define LOG_STR_LEN			64
 
 const char *client_joined = "Server: [%s] has joined the chat\n";
 const char *client_left = "Server: [%s] has left the chat\n";
 const char *etoiles = "****************************************************************";
 
-typedef enum CLIENT_TYPE
-{
-	REGULAR, ADMINISTRATOR
-} client_type;
-
-typedef enum CLIENT_STATUS
-{
-	VISIBLE, INVISIBLE
-} client_status;
-
+// cold per client data, only touched on join, /list, /kick, /change and private messages
 typedef struct CLIENT_INFO
 {
-	int sock;								// socket to send / recv data
-	char ip[INET6_ADDRSTRLEN];				// server ip
-	char port[5];							// server port
-	char pseudo[PSEUDO_LEN];
+	char ip[INET6_ADDRSTRLEN];				// client ip
+	char port[NI_MAXSERV];					// client port
+	char pseudo[PSEUDO_LEN + 1];			// always NUL terminated, PSEUDO_LEN bytes at most
 	client_type type;
 	client_status status;
+	uint32_t caps;							// transports the client asked for
+	uint32_t dict_id;						// compression dictionary of the client, 0 if none
+	unsigned char token[TOKEN_LEN];			// presented by the client to resume its session
+	uint64_t resume_seq;					// last sequence number seen by a resuming client
+	time_t detached_at;						// CLOCK_MONOTONIC seconds when the connection was lost
 } client_info;
 
-void print_client_info(client_info *ci);
+// accepted connection whose handshake has not fully arrived yet
+typedef struct HANDSHAKE
+{
+	int fd;
+	int family;								// of the listener it came through
+	time_t since;							// CLOCK_MONOTONIC seconds
+	size_t len;
+	char buf[HANDSHAKE_LEN];
+	client_info ci;							// ip and port, the rest is parsed once buf is full
+} handshake;
+
+// hot per client flags, mirrors of the cold fields the event loop needs per message
+#define CF_INVISIBLE		0x01
+#define CF_ADMINISTRATOR	0x02
+#define CF_ZEROCOPY			0x04			// SO_ZEROCOPY is on and the kernel did not fall back to copying
+#define CF_CLOSING			0x08			// connection lost, detached at the end of the loop iteration
+#define CF_KICKED			0x10			// kicked out, removed at the end of the loop iteration
+#define CF_SHM				0x20			// server to client frames go through a shared memory ring
+#define CF_DETACHED			0x40			// no connection, the slot waits for the client to resume
+#define CF_QUIT				0x80			// said /quit, removed at the end of the loop iteration
+#define CF_DEFLATE			0x100			// frames of at least COMPRESS_MIN bytes are sent compressed
+#define CF_GONE				(CF_CLOSING | CF_KICKED | CF_QUIT)
+#define CF_OFFLINE			(CF_GONE | CF_DETACHED)
+
+typedef enum TRACE_STAGE
+{
+	STAGE_UPLINK,							// send -> recv: sender socket and kernel queues
+	STAGE_PARSE,							// recv -> dispatch: frames read in the same batch before it
+	STAGE_HANDLE,							// dispatch -> enqueue
+	STAGE_FANOUT,							// enqueue -> every recipient's send returned
+	TRACE_STAGES
+} trace_stage;
+
+// one deflate context for the whole server, reset for every buffer it compresses
+typedef struct COMPRESSOR
+{
+	z_stream zs;
+	int level;								// 0 when compression is disabled
+	uint32_t dict_id;						// adler32 of the dictionary, checked by the clients
+	unsigned long buffers;
+	uint64_t in;							// bytes before compression
+	uint64_t out;							// bytes sent, compressed or not
+	uint64_t ns;							// cpu time spent compressing
+} compressor;
+
+// framed message shared by every recipient of a broadcast and by the history
+typedef struct SHARED_BUF
+{
+	int refs;
+	uint64_t seq;							// sequence number of the chat message, 0 otherwise
+	unsigned char sender[TOKEN_LEN];		// session token of the author of a chat message, zeros otherwise
+	struct SHARED_BUF *deflated;			// compressed once for every client that asked, see shared_buf_deflated()
+	size_t len;
+	char data[];
+} shared_buf;
+
+typedef struct ZC_PENDING
+{
+	uint32_t id;							// zerocopy notification id the kernel gave this send
+	int done;
+	shared_buf *buf;
+} zc_pending;
+
+// MSG_ZEROCOPY sends whose buffers the kernel may still be reading
+typedef struct ZC_STATE
+{
+	uint32_t next_id;						// the kernel numbers zerocopy sends per socket from 0
+	int head;
+	int count;
+	zc_pending pending[ZC_MAX_PENDING];
+} zc_state;
+
+// connection of a client that is gone, kept open until the kernel is done with its zerocopy buffers
+typedef struct ZC_LINGERING
+{
+	int fd;
+	time_t since;							// CLOCK_MONOTONIC seconds
+	zc_state *zc;
+} zc_lingering;
+
+typedef struct SHM_LINK
+{
+	shm_ring *ring;
+	uint32_t head;							// what the server published
+	uint32_t size;
+	size_t map_len;
+	int efd;								// eventfd used to wake the client up
+} shm_link;
+
+// bytes received from a client that do not form a complete frame yet
+typedef struct CLIENT_RX
+{
+	char *buf;
+	size_t len;
+	size_t cap;
+} client_rx;
+
+/*
+ * structure of arrays: the fd_set rebuild and the broadcast loop only walk
+ * the packed fd[] array, so a cache line covers 16 clients instead of one
+ * slot i in every array belongs to the same client
+*/
+typedef struct CLIENT_TABLE
+{
+	int nb;									// number of used slots, always packed at the front
+	int cap;								// slots in every array, see client_table_init()
+	int *fd;
+	unsigned short *flags;
+	zc_state **zc;							// NULL until the first zerocopy send
+	shm_link **shm;							// NULL unless CF_SHM
+	client_rx *rx;
+	client_info *info;
+} client_table;
+
+// last chat messages, oldest first starting at head, their sequence numbers follow each other
+typedef struct HISTORY
+{
+	int head;
+	int count;
+	uint64_t next_seq;						// given to the next chat message, starts at 1
+	shared_buf *msgs[HISTORY_LEN];
+	shared_buf *replay;						// the last JOIN_REPLAY messages in one buffer, built on the first join
+} history;
+
+// a chat message to index (seq != 0) or a search to run for the session holding token
+typedef struct INDEX_JOB
+{
+	uint64_t seq;
+	unsigned char token[TOKEN_LEN];
+	char author[PSEUDO_LEN + 1];			// pseudo of the sender of a chat message
+	size_t len;
+	char text[];
+} index_job;
+
+// answer to a search, sent to the session holding token if it is still around
+typedef struct INDEX_ANSWER
+{
+	unsigned char token[TOKEN_LEN];
+	size_t len;
+	char text[];
+} index_answer;
+
+// single producer / single consumer queue of pointers between the event loop and the index thread
+typedef struct PTR_RING
+{
+	_Alignas(64) atomic_size_t head;		// only written by the producer
+	_Alignas(64) atomic_size_t tail;		// only written by the consumer
+	void *slots[INDEX_JOBS];
+} ptr_ring;
+
+// a term of a segment and the messages of the segment it appears in
+typedef struct POSTING
+{
+	char *term;								// NULL for a free table entry
+	uint32_t hash;
+	uint32_t count;							// messages in the list
+	uint32_t next;							// last message number appended plus one, 0 if none
+	uint32_t len;
+	uint32_t cap;
+	unsigned char *list;					// gaps between message numbers, LEB128 varints
+} posting;
+
+// INDEX_SEGMENT_LEN chat messages in sequence order, their text and the postings of their terms
+typedef struct INDEX_SEGMENT
+{
+	uint32_t count;
+	uint64_t seqs[INDEX_SEGMENT_LEN];
+	uint32_t offsets[INDEX_SEGMENT_LEN + 1];	// message n is text + offsets[n], NUL terminated
+	char *text;
+	size_t text_cap;
+	posting *table;							// open addressing, power of two entries
+	uint32_t table_size;
+	uint32_t nb_terms;
+	size_t bytes;							// memory counted against the budget
+	struct INDEX_SEGMENT *older;
+} index_segment;
+
+typedef struct SEARCH_INDEX
+{
+	ptr_ring jobs;							// event loop -> index thread
+	ptr_ring answers;						// index thread -> event loop
+	atomic_ulong dropped;					// messages left out because the job queue was full
+	_Alignas(64) atomic_int sleeping;		// the index thread waits on wake_efd until woken
+	int running;
+	int efd;								// readable when answers are waiting
+	int wake_efd;							// written by the event loop when the index thread sleeps
+	pthread_t thread;
+	size_t budget;							// bytes, segments are dropped oldest first above it
+	// only touched by the index thread
+	index_segment *newest;
+	int nb_segments;
+	size_t bytes;
+} search_index;
+
+typedef enum LOG_LEVEL
+{
+	LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR
+} log_level;
+
+// tells the log thread which arguments of the record the format consumes
+typedef enum LOG_ARGS
+{
+	LOG_ARGS_NONE, LOG_ARGS_STR, LOG_ARGS_INT, LOG_ARGS_STR_INT, LOG_ARGS_ERRNO
+} log_args;
+
+// fixed-size binary record, filled by the event loop and formatted by the log thread
+typedef struct LOG_RECORD
+{
+	struct timespec ts;
+	log_level level;
+	log_args args;
+	const char *fmt;						// must point to a string literal
+	long num;
+	char str[LOG_STR_LEN];
+} log_record;
+
+// single producer (event loop) / single consumer (log thread) ring
+typedef struct LOG_RING
+{
+	_Alignas(64) atomic_size_t head;		// only written by the event loop
+	_Alignas(64) atomic_size_t tail;		// only written by the log thread
+	_Alignas(64) atomic_ulong dropped;		// records lost because the ring was full
+	_Alignas(64) atomic_int sleeping;		// the log thread waits on efd until woken
+	atomic_int stop;
+	int efd;
+	log_level min_level;
+	int running;
+	FILE *out;
+	pthread_t thread;
+	log_record records[LOG_RING_SIZE];
+} log_ring;
+
+static log_ring logger;
+static history backlog;
+static search_index searcher;
+static stage_stats trace_stats[TRACE_STAGES];
+static compressor deflater;
+static zc_lingering lingering[MAX_CLIENTS];
+static int nb_lingering;
+static handshake handshakes[HANDSHAKE_MAX];
+static int nb_handshakes;
+static size_t zerocopy_threshold = ZC_THRESHOLD;	// 0 disables MSG_ZEROCOPY
+
+const char *log_level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+const char *stage_names[] = { "uplink", "parse", "handle", "fanout" };
+
+void print_client_info(int sock, client_info *ci);
+int send_shared(client_table *clients, int slot, shared_buf *buf);
+int admit_client(client_table *clients, int sock, client_info *info, int family);
+void log_stop(void);
 
 void die_error(const char *msg)
 {
+	// make sure whatever was logged before dying reaches the output
+	log_stop();
 	perror(msg);
 	exit(-1);
 }
 
-int recv_client_info(client_info *ci)
+// allocate the arrays of an empty table of cap slots
+void client_table_init(client_table *clients, int cap)
+{
+	memset(clients, 0, sizeof(client_table));
+	clients->cap = cap;
+	clients->fd = calloc(cap, sizeof(int));
+	clients->flags = calloc(cap, sizeof(unsigned short));
+	clients->zc = calloc(cap, sizeof(zc_state *));
+	clients->shm = calloc(cap, sizeof(shm_link *));
+	clients->rx = calloc(cap, sizeof(client_rx));
+	clients->info = calloc(cap, sizeof(client_info));
+	if( clients->fd == NULL || clients->flags == NULL || clients->zc == NULL || clients->shm == NULL
+		|| clients->rx == NULL || clients->info == NULL )
+	{
+		die_error("client table");
+	}
+	
+	return;
+}
+
+void client_table_free(client_table *clients)
+{
+	free(clients->fd);
+	free(clients->flags);
+	free(clients->zc);
+	free(clients->shm);
+	free(clients->rx);
+	free(clients->info);
+	memset(clients, 0, sizeof(client_table));
+	
+	return;
+}
+
+/*
+ * consumer thread with nothing to do: sleep on efd until the producer sees *sleeping
+ * and wakes us up, unless something was published while we were deciding to sleep
+ * head, tail: counters of the ring the thread consumes
+*/
+void idle_wait(atomic_int *sleeping, int efd, atomic_size_t *head, size_t tail)
+{
+	uint64_t wakeups;
+	
+	atomic_store_explicit(sleeping, 1, memory_order_seq_cst);
+	if( atomic_load_explicit(head, memory_order_seq_cst) == tail )
+	{
+		// blocking read, a failure (EINTR) only means the caller looks at its ring again
+		if( read(efd, &wakeups, sizeof(wakeups)) == -1 )
+		{
+			wakeups = 0;
+		}
+	}
+	atomic_store_explicit(sleeping, 0, memory_order_relaxed);
+	
+	return;
+}
+
+/*
+ * producer side, after publishing: only pay for the eventfd write when the consumer said it sleeps
+ * return value: 0, -1 if the write failed
+*/
+int idle_wake(atomic_int *sleeping, int efd)
+{
+	uint64_t one = 1;
+	
+	if( atomic_exchange_explicit(sleeping, 0, memory_order_seq_cst) && write(efd, &one, sizeof(one)) == -1 )
+	{
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * @params
+ * level: severity of the record
+ * return value: a record to fill in and publish with log_commit(), NULL if
+ * the level is filtered out or the ring is full (the record is counted as dropped)
+*/
+log_record *log_reserve(log_level level)
+{
+	if( level < logger.min_level || !logger.running )
+	{
+		return NULL;
+	}
+	
+	size_t head = atomic_load_explicit(&logger.head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&logger.tail, memory_order_acquire);
+	if( head - tail == LOG_RING_SIZE )
+	{
+		// never wait for the log thread, losing a line is better than stalling the chat
+		atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+	
+	log_record *r = &logger.records[head & (LOG_RING_SIZE - 1)];
+	clock_gettime(CLOCK_REALTIME, &r->ts);
+	r->level = level;
+	r->args = LOG_ARGS_NONE;
+	r->num = 0;
+	r->str[0] = '\0';
+	
+	return r;
+}
+
+void log_commit(void)
+{
+	size_t head = atomic_load_explicit(&logger.head, memory_order_relaxed);
+	atomic_store_explicit(&logger.head, head + 1, memory_order_seq_cst);
+	// nowhere to report a failed wake up, the record is printed with the next one
+	idle_wake(&logger.sleeping, logger.efd);
+	
+	return;
+}
+
+// str must be NUL terminated, it is cut to what the record holds
+void log_copy_str(log_record *r, const char *str)
+{
+	size_t len = strlen(str);
+	if( len > LOG_STR_LEN - 1 )
+	{
+		len = LOG_STR_LEN - 1;
+	}
+	memcpy(r->str, str, len);
+	r->str[len] = '\0';
+	
+	return;
+}
+
+void log_msg(log_level level, const char *fmt)
+{
+	log_record *r = log_reserve(level);
+	if( r == NULL )
+	{
+		return;
+	}
+	r->fmt = fmt;
+	log_commit();
+	
+	return;
+}
+
+void log_str(log_level level, const char *fmt, const char *str)
+{
+	log_record *r = log_reserve(level);
+	if( r == NULL )
+	{
+		return;
+	}
+	r->fmt = fmt;
+	r->args = LOG_ARGS_STR;
+	log_copy_str(r, str);
+	log_commit();
+	
+	return;
+}
+
+void log_int(log_level level, const char *fmt, long num)
+{
+	log_record *r = log_reserve(level);
+	if( r == NULL )
+	{
+		return;
+	}
+	r->fmt = fmt;
+	r->args = LOG_ARGS_INT;
+	r->num = num;
+	log_commit();
+	
+	return;
+}
+
+void log_str_int(log_level level, const char *fmt, const char *str, long num)
+{
+	log_record *r = log_reserve(level);
+	if( r == NULL )
+	{
+		return;
+	}
+	r->fmt = fmt;
+	r->args = LOG_ARGS_STR_INT;
+	r->num = num;
+	log_copy_str(r, str);
+	log_commit();
+	
+	return;
+}
+
+// replacement for perror() on the hot path, errno is captured now and formatted later
+void log_errno(log_level level, const char *what)
+{
+	int saved_errno = errno;
+	log_record *r = log_reserve(level);
+	if( r == NULL )
+	{
+		return;
+	}
+	r->fmt = "%s: %s";
+	r->args = LOG_ARGS_ERRNO;
+	r->num = saved_errno;
+	log_copy_str(r, what);
+	log_commit();
+	
+	return;
+}
+
+void log_format_record(FILE *out, log_record *r)
+{
+	struct tm tm;
+	char when[32];
+	
+	localtime_r(&r->ts.tv_sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(out, "%s.%03ld %-5s ", when, r->ts.tv_nsec / 1000000, log_level_names[r->level]);
+	
+	switch( r->args )
+	{
+		case LOG_ARGS_NONE:
+			fputs(r->fmt, out);
+			break;
+		case LOG_ARGS_STR:
+			fprintf(out, r->fmt, r->str);
+			break;
+		case LOG_ARGS_INT:
+			fprintf(out, r->fmt, r->num);
+			break;
+		case LOG_ARGS_STR_INT:
+			fprintf(out, r->fmt, r->str, r->num);
+			break;
+		case LOG_ARGS_ERRNO:
+			fprintf(out, r->fmt, r->str, strerror(r->num));
+			break;
+	}
+	fputc('\n', out);
+	
+	return;
+}
+
+void *log_thread(void *arg)
+{
+	unsigned long reported = 0, dropped;
+	(void)arg;
+	
+	for( ;; )
+	{
+		size_t tail = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&logger.head, memory_order_acquire);
+		
+		while( tail != head )
+		{
+			log_format_record(logger.out, &logger.records[tail & (LOG_RING_SIZE - 1)]);
+			tail += 1;
+			// hand the slot back as soon as it has been formatted
+			atomic_store_explicit(&logger.tail, tail, memory_order_release);
+		}
+		
+		dropped = atomic_load_explicit(&logger.dropped, memory_order_relaxed);
+		if( dropped != reported )
+		{
+			fprintf(logger.out, "log: %lu records dropped (ring full)\n", dropped - reported);
+			reported = dropped;
+		}
+		
+		// the ring is drained, push everything out in one write
+		fflush(logger.out);
+		
+		if( atomic_load_explicit(&logger.stop, memory_order_acquire) )
+		{
+			// one last pass in case records were committed while we were flushing
+			if( atomic_load_explicit(&logger.head, memory_order_acquire) == tail )
+			{
+				break;
+			}
+			continue;
+		}
+		idle_wait(&logger.sleeping, logger.efd, &logger.head, tail);
+	}
+	
+	return NULL;
+}
+
+/*
+ * @params
+ * out: where the log thread writes formatted records
+ * min_level: records below this level are discarded by the event loop
+*/
+void log_start(FILE *out, log_level min_level)
+{
+	logger.out = out;
+	logger.min_level = min_level;
+	atomic_init(&logger.head, 0);
+	atomic_init(&logger.tail, 0);
+	atomic_init(&logger.dropped, 0);
+	atomic_init(&logger.sleeping, 0);
+	atomic_init(&logger.stop, 0);
+	logger.efd = eventfd(0, EFD_CLOEXEC);
+	if( logger.efd == -1 )
+	{
+		die_error("log eventfd");
+	}
+	
+	// the log thread flushes once per drained batch, not once per line
+	setvbuf(out, NULL, _IOFBF, BUFSIZ);
+	
+	if( pthread_create(&logger.thread, NULL, log_thread, NULL) != 0 )
+	{
+		die_error("log thread");
+	}
+	logger.running = 1;
+	
+	return;
+}
+
+void log_stop(void)
+{
+	if( !logger.running )
+	{
+		return;
+	}
+	logger.running = 0;
+	uint64_t one = 1;
+	atomic_store_explicit(&logger.stop, 1, memory_order_release);
+	// wake the log thread up whether it sleeps or not, the counter stays set until it reads it
+	if( write(logger.efd, &one, sizeof(one)) == -1 )
+	{
+		perror("log wake up");
+	}
+	pthread_join(logger.thread, NULL);
+	close(logger.efd);
+	
+	return;
+}
+
+// returns the log level matching name, -1 if unknown
+int parse_log_level(const char *name)
+{
+	int i;
+	for( i = LOG_DEBUG; i <= LOG_ERROR; ++i )
+	{
+		if( !strcasecmp(name, log_level_names[i]) )
+		{
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+/*
+ * @params
+ * buf: the HANDSHAKE_LEN bytes a client sends when it connects
+ * ci: filled with what they say, ip and port are left alone
+ * return value: 0, -1 if the client sent garbage
+*/
+int parse_client_info(const char *buf, client_info *ci)
+{
+	// pseudo first, the extra byte of ci->pseudo keeps it terminated whatever the client sent
+	memset(&ci->pseudo, 0, sizeof(ci->pseudo));
+	memcpy(ci->pseudo, buf, PSEUDO_LEN);
+	buf += PSEUDO_LEN;
+	log_str(LOG_DEBUG, "pseudo: %s", ci->pseudo);
+	
+	// client type - administrator, regular, ..
+	memcpy(&ci->type, buf, sizeof(ci->type));
+	buf += sizeof(ci->type);
+	// check type in case of connection error and receiving incorrect data
+	// if more user types are added, they need to be checked here
+	if( ci->type != REGULAR && ci->type != ADMINISTRATOR )
+	{
+		log_msg(LOG_WARN, "error in connection - type");
+		return -1;
+	}
+	log_int(LOG_DEBUG, "type is %ld", ci->type);
+	
+	// client status - visible, invisible, ..
+	memcpy(&ci->status, buf, sizeof(ci->status));
+	buf += sizeof(ci->status);
+	if( ci->status != VISIBLE && ci->status != INVISIBLE )
+	{
+		log_msg(LOG_WARN, "error in connection - status");
+		return -1;
+	}
+	log_int(LOG_DEBUG, "status is %ld", ci->status);
+	
+	// the transports the client would like to use and its compression dictionary
+	memcpy(&ci->caps, buf, sizeof(ci->caps));
+	buf += sizeof(ci->caps);
+	ci->caps = ntohl(ci->caps);
+	log_int(LOG_DEBUG, "caps are %ld", ci->caps);
+	memcpy(&ci->dict_id, buf, sizeof(ci->dict_id));
+	buf += sizeof(ci->dict_id);
+	ci->dict_id = ntohl(ci->dict_id);
+	
+	// the session to resume (all zero for a new one) and the last message the client saw
+	memcpy(ci->token, buf, TOKEN_LEN);
+	buf += TOKEN_LEN;
+	memcpy(&ci->resume_seq, buf, sizeof(ci->resume_seq));
+	ci->resume_seq = be64toh(ci->resume_seq);
+	
+	return 0;
+}
+
+/*
+ * @params
+ * type: frame type
+ * seq: sequence number of a chat message, 0 for anything else
+ * payload: message to frame, does not need to be NUL terminated
+ * len: payload length
+ * return value: a buffer holding the header and the payload with one reference
+*/
+shared_buf *shared_buf_frame(frame_type type, uint64_t seq, const char *payload, size_t len)
+{
+	shared_buf *buf = malloc(sizeof(shared_buf) + sizeof(frame_hdr) + len);
+	if( buf == NULL )
+	{
+		die_error("shared buffer");
+	}
+	
+	frame_hdr hdr = { htonl(len), htonl(type), htobe64(seq) };
+	memcpy(buf->data, &hdr, sizeof(hdr));
+	memcpy(buf->data + sizeof(hdr), payload, len);
+	buf->len = sizeof(hdr) + len;
+	buf->seq = seq;
+	memset(buf->sender, 0, TOKEN_LEN);
+	buf->deflated = NULL;
+	buf->refs = 1;
+	
+	return buf;
+}
+
+shared_buf *shared_buf_ref(shared_buf *buf)
+{
+	buf->refs += 1;
+	
+	return buf;
+}
+
+void shared_buf_unref(shared_buf *buf)
+{
+	buf->refs -= 1;
+	if( buf->refs == 0 )
+	{
+		if( buf->deflated != NULL && buf->deflated != buf )
+		{
+			shared_buf_unref(buf->deflated);
+		}
+		free(buf);
+	}
+	
+	return;
+}
+
+/*
+ * @params
+ * sock: where to send
+ * buf: data to send, sent until everything is out or the connection fails
+ * return value: 0 on success, -1 if the connection is broken
+*/
+int send_buffer(int sock, const char *buf, size_t len)
+{
+	ssize_t bytes_sent;
+	while( len > 0 )
+	{
+		// MSG_NOSIGNAL: a client that went away must not take the server down with SIGPIPE
+		bytes_sent = send(sock, buf, len, MSG_NOSIGNAL);
+		if( bytes_sent == -1 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			log_errno(LOG_WARN, "send message");
+			return -1;
+		}
+		buf += bytes_sent;
+		len -= bytes_sent;
+	}
+	
+	return 0;
+}
+
+// frame and send a message meant for a single client
+int send_frame(int sock, frame_type type, const char *payload, size_t len)
+{
+	frame_hdr hdr = { htonl(len), htonl(type), 0 };
+	struct iovec iov[2] = { { &hdr, sizeof(hdr) }, { (void *)payload, len } };
+	struct msghdr msg;
+	ssize_t bytes_sent;
+	
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	do
+	{
+		bytes_sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while( bytes_sent == -1 && errno == EINTR );
+	if( bytes_sent == -1 )
+	{
+		log_errno(LOG_WARN, "send message");
+		return -1;
+	}
+	
+	// short send, push out what is left of the header and then the payload
+	if( (size_t)bytes_sent < sizeof(hdr) )
+	{
+		if( send_buffer(sock, (char *)&hdr + bytes_sent, sizeof(hdr) - bytes_sent) == -1 )
+		{
+			return -1;
+		}
+		bytes_sent = sizeof(hdr);
+	}
+	
+	return send_buffer(sock, payload + (bytes_sent - sizeof(hdr)), len - (bytes_sent - sizeof(hdr)));
+}
+
+// free bytes in the ring, head and tail are free running byte counters, -1 if the client broke the tail
+int64_t shm_space(shm_link *link)
+{
+	uint32_t tail = atomic_load_explicit(&link->ring->tail, memory_order_acquire);
+	
+	if( link->head - tail > link->size )
+	{
+		return -1;
+	}
+	
+	return link->size - (link->head - tail);
+}
+
+void shm_copy_in(shm_link *link, uint32_t pos, const char *src, size_t len)
+{
+	uint32_t off = pos & (link->size - 1);
+	size_t first = link->size - off;
+	if( len == 0 )
+	{
+		return;
+	}
+	if( first > len )
+	{
+		first = len;
+	}
+	memcpy(link->ring->data + off, src, first);
+	memcpy(link->ring->data, src + first, len - first);
+	
+	return;
+}
+
+/*
+ * @params
+ * link: shared memory transport of the recipient
+ * a, b: the two parts of the frame to publish (header and payload, or a whole frame and nothing)
+ * return value: 0 if the frame is in the ring, -1 if it did not fit (the frame is counted as dropped),
+ * -2 if the client wrote a tail that makes no sense, it must be disconnected
+*/
+int shm_push(shm_link *link, const char *a, size_t alen, const char *b, size_t blen)
+{
+	shm_ring *ring = link->ring;
+	int64_t space = shm_space(link);
+	
+	if( space == -1 )
+	{
+		return -2;
+	}
+	if( (int64_t)(alen + blen) > space )
+	{
+		// a local consumer that does not keep up loses messages, it never slows the chat down
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return -1;
+	}
+	
+	shm_copy_in(link, link->head, a, alen);
+	shm_copy_in(link, link->head + alen, b, blen);
+	link->head += alen + blen;
+	atomic_store_explicit(&ring->head, link->head, memory_order_seq_cst);
+	
+	// only pay for the eventfd write when the client said it is going to sleep
+	if( atomic_exchange_explicit(&ring->waiting, 0, memory_order_seq_cst) )
+	{
+		uint64_t one = 1;
+		if( write(link->efd, &one, sizeof(one)) == -1 )
+		{
+			log_errno(LOG_WARN, "eventfd");
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * push a frame to the ring of the client in slot, a client that corrupted its ring is marked as closing
+ * return value: 0, -1 if the client is being disconnected
+*/
+int shm_send(client_table *clients, int slot, const char *a, size_t alen, const char *b, size_t blen)
+{
+	if( shm_push(clients->shm[slot], a, alen, b, blen) == -2 )
+	{
+		log_str(LOG_WARN, "%s corrupted its shared memory ring, disconnecting", clients->info[slot].pseudo);
+		clients->flags[slot] |= CF_CLOSING;
+		return -1;
+	}
+	
+	return 0;
+}
+
+void shm_release(client_table *clients, int slot)
+{
+	shm_link *link = clients->shm[slot];
+	if( link == NULL )
+	{
+		return;
+	}
+	
+	munmap(link->ring, link->map_len);
+	close(link->efd);
+	free(link);
+	clients->shm[slot] = NULL;
+	
+	return;
+}
+
+/*
+ * answer a client that asked for the shared memory transport: a memfd holding the
+ * ring and an eventfd are passed over the unix socket, or nothing if the client
+ * is not local or the setup failed, in which case it keeps using the socket
+*/
+void shm_offer(client_table *clients, int slot, int family)
+{
+	frame_hdr hdr = { htonl(sizeof(uint32_t)), htonl(FRAME_SHM), 0 };
+	uint32_t ring_size = htonl(SHM_RING_SIZE);
+	struct iovec iov[2] = { { &hdr, sizeof(hdr) }, { &ring_size, sizeof(ring_size) } };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int) * 2)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	shm_link *link = NULL;
+	int memfd = -1, fds[2];
+	
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	
+	// file descriptors can only travel over a unix socket
+	if( family == AF_UNIX )
+	{
+		link = calloc(1, sizeof(shm_link));
+		memfd = memfd_create("multichat-ring", MFD_CLOEXEC);
+	}
+	if( link != NULL && memfd != -1 )
+	{
+		link->map_len = sizeof(shm_ring) + SHM_RING_SIZE;
+		link->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		link->ring = MAP_FAILED;
+		if( link->efd != -1 && ftruncate(memfd, link->map_len) == 0 )
+		{
+			link->ring = mmap(NULL, link->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+		}
+		if( link->ring != MAP_FAILED )
+		{
+			link->size = SHM_RING_SIZE;
+			link->ring->size = SHM_RING_SIZE;
+			fds[0] = memfd;
+			fds[1] = link->efd;
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof(control.buf);
+			cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(fds));
+			memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+		}
+		else
+		{
+			log_errno(LOG_WARN, "shared memory ring");
+			if( link->efd != -1 )
+			{
+				close(link->efd);
+			}
+			free(link);
+			link = NULL;
+		}
+	}
+	else
+	{
+		free(link);
+		link = NULL;
+	}
+	
+	if( link == NULL )
+	{
+		// refused: an empty answer, the client stays on the socket
+		hdr.len = 0;
+		msg.msg_iovlen = 1;
+	}
+	
+	if( sendmsg(clients->fd[slot], &msg, MSG_NOSIGNAL) == -1 )
+	{
+		log_errno(LOG_WARN, "shared memory offer");
+		clients->flags[slot] |= CF_CLOSING;
+	}
+	// the client has its own copy of the descriptor, the mapping keeps the memory alive
+	if( memfd != -1 )
+	{
+		close(memfd);
+	}
+	
+	if( link != NULL )
+	{
+		clients->shm[slot] = link;
+		clients->flags[slot] |= CF_SHM;
+		log_str(LOG_INFO, "%s uses the shared memory transport", clients->info[slot].pseudo);
+	}
+	
+	return;
+}
+
+void compress_start(int level)
+{
+	if( level == 0 )
+	{
+		return;
+	}
+	memset(&deflater.zs, 0, sizeof(z_stream));
+	// raw deflate: the frame says how long the result is, no need for zlib headers
+	if( deflateInit2(&deflater.zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+	{
+		die_error("deflate init");
+	}
+	deflater.level = level;
+	deflater.dict_id = adler32(adler32(0, NULL, 0), (const Bytef *)compress_dict, sizeof(compress_dict) - 1);
+	
+	return;
+}
+
+// compression is offered to remote clients that asked for it with our dictionary, local ones have bandwidth to spare
+void compress_enable(client_table *clients, int slot, int family)
+{
+	if( deflater.level == 0 || !(clients->info[slot].caps & CAP_DEFLATE) || family == AF_UNIX )
+	{
+		return;
+	}
+	if( clients->info[slot].dict_id != deflater.dict_id )
+	{
+		// another version of the dictionary, the client could not inflate anything we send
+		log_str(LOG_INFO, "%s has another compression dictionary, sending uncompressed", clients->info[slot].pseudo);
+		return;
+	}
+	clients->flags[slot] |= CF_DEFLATE;
+	
+	return;
+}
+
+/*
+ * compress head and body (one or more whole frames) with the shared dictionary into a FRAME_DEFLATE,
+ * the same compressor context is reset and reused for every buffer
+ * return value: a new shared buffer, NULL if compressing does not make it smaller
+*/
+shared_buf *compress_frames(const char *head, size_t head_len, const char *body, size_t body_len)
+{
+	size_t len = head_len + body_len, bound;
+	struct timespec start, end;
+	shared_buf *buf;
+	uint32_t info[2];
+	
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	
+	bound = deflateBound(&deflater.zs, len);
+	if( bound > MAX_PAYLOAD - sizeof(info) )
+	{
+		bound = MAX_PAYLOAD - sizeof(info);
+	}
+	buf = malloc(sizeof(shared_buf) + sizeof(frame_hdr) + sizeof(info) + bound);
+	if( buf == NULL )
+	{
+		die_error("compress buffer");
+	}
+	
+	deflateReset(&deflater.zs);
+	deflateSetDictionary(&deflater.zs, (const Bytef *)compress_dict, sizeof(compress_dict) - 1);
+	deflater.zs.next_out = (Bytef *)buf->data + sizeof(frame_hdr) + sizeof(info);
+	deflater.zs.avail_out = bound;
+	deflater.zs.next_in = (Bytef *)head;
+	deflater.zs.avail_in = head_len;
+	int status = deflate(&deflater.zs, body_len ? Z_NO_FLUSH : Z_FINISH);
+	if( status == Z_OK && body_len > 0 )
+	{
+		deflater.zs.next_in = (Bytef *)body;
+		deflater.zs.avail_in = body_len;
+		status = deflate(&deflater.zs, Z_FINISH);
+	}
+	
+	size_t out = bound - deflater.zs.avail_out;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	deflater.buffers += 1;
+	deflater.in += len;
+	deflater.out += (status == Z_STREAM_END && out + sizeof(info) < len) ? out + sizeof(info) : len;
+	deflater.ns += (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+	if( deflater.buffers % COMPRESS_REPORT == 0 )
+	{
+		char report[LOG_STR_LEN];
+		snprintf(report, sizeof(report), "%lu buffers, %.1f%% of the size, %.1f us cpu each", deflater.buffers,
+				100.0 * deflater.out / deflater.in, deflater.ns / 1000.0 / deflater.buffers);
+		log_str(LOG_INFO, "compression: %s", report);
+	}
+	
+	if( status != Z_STREAM_END || out + sizeof(info) >= len )
+	{
+		// does not fit in a frame or does not pay
+		free(buf);
+		return NULL;
+	}
+	
+	frame_hdr hdr = { htonl(sizeof(info) + out), htonl(FRAME_DEFLATE), 0 };
+	info[0] = htonl(deflater.dict_id);
+	info[1] = htonl(len);
+	memcpy(buf->data, &hdr, sizeof(hdr));
+	memcpy(buf->data + sizeof(hdr), info, sizeof(info));
+	buf->len = sizeof(hdr) + sizeof(info) + out;
+	buf->seq = 0;
+	memset(buf->sender, 0, TOKEN_LEN);
+	buf->refs = 1;
+	// already as small as it gets
+	buf->deflated = buf;
+	
+	return buf;
+}
+
+/*
+ * the compressed version of a shared buffer, made the first time a client that
+ * compresses needs it and then shared by all of them
+ * return value: the compressed buffer, buf itself when compressing does not pay
+*/
+shared_buf *shared_buf_deflated(shared_buf *buf)
+{
+	if( buf->deflated == NULL )
+	{
+		buf->deflated = (buf->len >= COMPRESS_MIN) ? compress_frames(buf->data, buf->len, NULL, 0) : NULL;
+		if( buf->deflated == NULL )
+		{
+			buf->deflated = buf;
+		}
+	}
+	
+	return buf->deflated;
+}
+
+/*
+ * @params
+ * clients: the client table
+ * slot: recipient, reached through the shared memory ring or its socket
+ * return value: 0 on success, -1 if the connection is broken (the client is marked as closing)
+*/
+int send_frame_to_client(client_table *clients, int slot, frame_type type, const char *payload, size_t len)
+{
+	if( clients->flags[slot] & CF_SHM )
+	{
+		frame_hdr hdr = { htonl(len), htonl(type), 0 };
+		return shm_send(clients, slot, (char *)&hdr, sizeof(hdr), payload, len);
+	}
+	if( (clients->flags[slot] & CF_DEFLATE) && len >= COMPRESS_MIN )
+	{
+		frame_hdr hdr = { htonl(len), htonl(type), 0 };
+		shared_buf *buf = compress_frames((char *)&hdr, sizeof(hdr), payload, len);
+		if( buf != NULL )
+		{
+			int res = send_shared(clients, slot, buf);
+			shared_buf_unref(buf);
+			return res;
+		}
+	}
+	if( send_frame(clients->fd[slot], type, payload, len) == -1 )
+	{
+		clients->flags[slot] |= CF_CLOSING;
+		return -1;
+	}
+	
+	return 0;
+}
+
+int send_message(client_table *clients, int slot, const char *msg)
+{
+	return send_frame_to_client(clients, slot, FRAME_TEXT, msg, strlen(msg));
+}
+
+/*
+ * turn on MSG_ZEROCOPY for a freshly accepted socket, the flag is simply left
+ * off when the kernel or the socket family does not support it
+*/
+void zc_enable(client_table *clients, int slot)
+{
+	int one = 1;
+	if( zerocopy_threshold == 0 )
+	{
+		return;
+	}
+	if( setsockopt(clients->fd[slot], SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1 )
+	{
+		log_errno(LOG_DEBUG, "zerocopy unavailable, using copies");
+		return;
+	}
+	clients->flags[slot] |= CF_ZEROCOPY;
+	
+	return;
+}
+
+// mark the sends numbered lo to hi (inclusive) as completed and release the buffers at the front
+void zc_complete(zc_state *zc, uint32_t lo, uint32_t hi)
+{
+	int i, slot;
+	for( i = 0; i < zc->count; ++i )
+	{
+		zc_pending *p = &zc->pending[(zc->head + i) % ZC_MAX_PENDING];
+		// ids wrap around, compare distances rather than values
+		if( (int32_t)(p->id - lo) >= 0 && (int32_t)(hi - p->id) >= 0 )
+		{
+			p->done = 1;
+		}
+	}
+	
+	while( zc->count > 0 && zc->pending[zc->head].done )
+	{
+		slot = zc->head;
+		shared_buf_unref(zc->pending[slot].buf);
+		zc->pending[slot].buf = NULL;
+		zc->head = (slot + 1) % ZC_MAX_PENDING;
+		zc->count -= 1;
+	}
+	
+	return;
+}
+
+/*
+ * read the zerocopy completion notifications queued on the socket error queue
+ * return value: 1 if the kernel said it had to copy the data anyway, 0 otherwise
+*/
+int zc_drain(int sock, zc_state *zc)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	int copied = 0;
+	
+	for( ;; )
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if( recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1 )
+		{
+			break;
+		}
+		
+		for( cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm) )
+		{
+			if( !(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+				!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR) )
+			{
+				continue;
+			}
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if( serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+			{
+				continue;
+			}
+			zc_complete(zc, serr->ee_info, serr->ee_data);
+			if( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+			{
+				copied = 1;
+			}
+		}
+	}
+	
+	return copied;
+}
+
+void zc_reap(client_table *clients, int slot)
+{
+	zc_state *zc = clients->zc[slot];
+	if( zc == NULL )
+	{
+		return;
+	}
+	
+	if( zc_drain(clients->fd[slot], zc) && (clients->flags[slot] & CF_ZEROCOPY) )
+	{
+		// the kernel had to copy anyway (loopback, no scatter-gather on the device, ..)
+		// pinning pages only costs us here, go back to plain sends for this client
+		clients->flags[slot] &= ~CF_ZEROCOPY;
+		log_str(LOG_DEBUG, "kernel copied the zerocopy sends to %s, using plain sends", clients->info[slot].pseudo);
+	}
+	
+	return;
+}
+
+/*
+ * close a connection and give back the buffers of its zerocopy sends
+ * abort: reset the connection so that nothing queued is sent anymore, the kernel
+ * pins the pages of the buffers but does not copy them, they could be reused otherwise
+*/
+void zc_free(int fd, zc_state *zc, int abort)
+{
+	struct linger reset = { 1, 0 };
+	
+	if( abort && setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset)) == -1 )
+	{
+		log_errno(LOG_WARN, "zerocopy abort");
+	}
+	close(fd);
+	if( zc == NULL )
+	{
+		return;
+	}
+	while( zc->count > 0 )
+	{
+		shared_buf_unref(zc->pending[zc->head].buf);
+		zc->head = (zc->head + 1) % ZC_MAX_PENDING;
+		zc->count -= 1;
+	}
+	free(zc);
+	
+	return;
+}
+
+/*
+ * close the connection of a client that is being detached or removed: while zerocopy sends
+ * are in flight the kernel still reads their buffers, so the socket is kept open in the
+ * background (the last frames, a kick notice for example, still go out) until the completions
+ * come back or ZC_LINGER seconds passed
+*/
+void zc_close(client_table *clients, int slot)
+{
+	zc_state *zc = clients->zc[slot];
+	int fd = clients->fd[slot];
+	struct timespec now;
+	
+	clients->zc[slot] = NULL;
+	clients->fd[slot] = -1;
+	if( fd == -1 )
+	{
+		return;
+	}
+	if( zc != NULL )
+	{
+		zc_drain(fd, zc);
+	}
+	if( zc == NULL || zc->count == 0 || nb_lingering == MAX_CLIENTS )
+	{
+		zc_free(fd, zc, zc != NULL && zc->count > 0);
+		return;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lingering[nb_lingering].fd = fd;
+	lingering[nb_lingering].since = now.tv_sec;
+	lingering[nb_lingering].zc = zc;
+	nb_lingering += 1;
+	
+	return;
+}
+
+/*
+ * close the lingering connections whose zerocopy sends all completed, abort those that waited too long
+ * return value: number of connections still lingering
+*/
+int zc_linger_sweep(time_t now)
+{
+	int i;
+	for( i = nb_lingering - 1; i >= 0; --i )
+	{
+		zc_lingering *l = &lingering[i];
+		zc_drain(l->fd, l->zc);
+		if( l->zc->count > 0 && now - l->since < ZC_LINGER )
+		{
+			continue;
+		}
+		if( l->zc->count > 0 )
+		{
+			log_int(LOG_DEBUG, "aborting a closed connection with %ld zerocopy sends in flight", l->zc->count);
+		}
+		zc_free(l->fd, l->zc, l->zc->count > 0);
+		*l = lingering[--nb_lingering];
+	}
+	
+	return nb_lingering;
+}
+
+/*
+ * @params
+ * clients: the client table
+ * slot: recipient
+ * buf: framed message, possibly shared with other recipients
+ * return value: 0 on success, -1 if the connection is broken (the client is marked as closing)
+*/
+int send_shared(client_table *clients, int slot, shared_buf *buf)
+{
+	int sock = clients->fd[slot];
+	zc_state *zc;
+	ssize_t bytes_sent = 0;
+	
+	if( clients->flags[slot] & CF_SHM )
+	{
+		return shm_send(clients, slot, buf->data, buf->len, NULL, 0);
+	}
+	if( clients->flags[slot] & CF_DEFLATE )
+	{
+		buf = shared_buf_deflated(buf);
+	}
+	
+	if( (clients->flags[slot] & CF_ZEROCOPY) && buf->len >= zerocopy_threshold )
+	{
+		zc = clients->zc[slot];
+		if( zc == NULL )
+		{
+			zc = clients->zc[slot] = calloc(1, sizeof(zc_state));
+		}
+		
+		if( zc != NULL && zc->count < ZC_MAX_PENDING )
+		{
+			// the kernel reads the pages of buf while sending, it must live until the completion
+			bytes_sent = send(sock, buf->data, buf->len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+			if( bytes_sent > 0 )
+			{
+				zc_pending *p = &zc->pending[(zc->head + zc->count) % ZC_MAX_PENDING];
+				p->id = zc->next_id++;
+				p->done = 0;
+				p->buf = shared_buf_ref(buf);
+				zc->count += 1;
+			}
+			else
+			{
+				// ENOBUFS when the socket ran out of optmem, copy instead
+				bytes_sent = 0;
+			}
+		}
+	}
+	
+	if( send_buffer(sock, buf->data + bytes_sent, buf->len - bytes_sent) == -1 )
+	{
+		clients->flags[slot] |= CF_CLOSING;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * @params
+ * clients: the client table
+ * buf: framed message, built once and shared by every recipient
+ * exclude: don't send to this client
+*/
+void send_to_all_clients(client_table *clients, shared_buf *buf, int exclude)
+{
+	// only the packed hot arrays are read here, the cold client info stays out of the cache
+	const unsigned short *flags = clients->flags;
+	int i, nb = clients->nb;
+	for( i = 0; i < nb; ++i )
+	{
+		if( i != exclude && !(flags[i] & CF_OFFLINE) )
+		{
+			send_shared(clients, i, buf);
+		}
+	}
+	
+	return;
+}
+
+// frame a server notice once and send it to everybody
+void send_notice_to_all_clients(client_table *clients, const char *notice, int exclude)
+{
+	shared_buf *buf = shared_buf_frame(FRAME_TEXT, 0, notice, strlen(notice));
+	send_to_all_clients(clients, buf, exclude);
+	shared_buf_unref(buf);
+	
+	return;
+}
+
+// keep a chat message for the clients that join later, the oldest one is dropped when full
+void history_push(history *h, shared_buf *buf)
+{
+	if( h->count == HISTORY_LEN )
+	{
+		shared_buf_unref(h->msgs[h->head]);
+		h->head = (h->head + 1) % HISTORY_LEN;
+		h->count -= 1;
+	}
+	h->msgs[(h->head + h->count) % HISTORY_LEN] = shared_buf_ref(buf);
+	h->count += 1;
+	
+	// the replay buffer no longer matches
+	if( h->replay != NULL )
+	{
+		shared_buf_unref(h->replay);
+		h->replay = NULL;
+	}
+	
+	return;
+}
+
+/*
+ * every client joining between two chat messages receives the same replay, so
+ * the frames are concatenated once and the result shared (and zerocopy sent)
+ * return value: the replay buffer, owned by the history, NULL if there is nothing to replay
+*/
+shared_buf *history_replay(history *h)
+{
+	int i, first = h->count > JOIN_REPLAY ? h->count - JOIN_REPLAY : 0;
+	size_t total = 0;
+	shared_buf *msg;
+	
+	if( h->count == 0 || h->replay != NULL )
+	{
+		return h->replay;
+	}
+	
+	for( i = first; i < h->count; ++i )
+	{
+		total += h->msgs[(h->head + i) % HISTORY_LEN]->len;
+	}
+	h->replay = malloc(sizeof(shared_buf) + total);
+	if( h->replay == NULL )
+	{
+		die_error("history replay");
+	}
+	h->replay->refs = 1;
+	h->replay->seq = 0;
+	memset(h->replay->sender, 0, TOKEN_LEN);
+	h->replay->deflated = NULL;
+	h->replay->len = 0;
+	for( i = first; i < h->count; ++i )
+	{
+		msg = h->msgs[(h->head + i) % HISTORY_LEN];
+		memcpy(h->replay->data + h->replay->len, msg->data, msg->len);
+		h->replay->len += msg->len;
+	}
+	
+	return h->replay;
+}
+
+/*
+ * catch a newcomer up with the last JOIN_REPLAY chat messages: the shared concatenation
+ * in one send, or for a client that compresses every message on its own, so that each
+ * one goes out with the compressed copy it already has instead of compressing them all again
+*/
+void history_send_replay(history *h, client_table *clients, int slot)
+{
+	int i, first = h->count > JOIN_REPLAY ? h->count - JOIN_REPLAY : 0;
+	shared_buf *replay;
+	
+	if( clients->flags[slot] & CF_DEFLATE )
+	{
+		for( i = first; i < h->count && !(clients->flags[slot] & CF_OFFLINE); ++i )
+		{
+			send_shared(clients, slot, h->msgs[(h->head + i) % HISTORY_LEN]);
+		}
+		return;
+	}
+	
+	replay = history_replay(h);
+	if( replay != NULL && !(clients->flags[slot] & CF_OFFLINE) )
+	{
+		send_shared(clients, slot, replay);
+	}
+	
+	return;
+}
+
+/*
+ * send a resumed client the chat messages numbered after last_seq, the numbers
+ * follow each other in the history so the first one to send is found directly
+*/
+void history_resume(history *h, client_table *clients, int slot, uint64_t last_seq)
+{
+	const unsigned char *token = clients->info[slot].token;
+	shared_buf *buf;
+	uint64_t oldest;
+	int i, first;
+	
+	if( h->count == 0 || last_seq + 1 >= h->next_seq )
+	{
+		// nothing was said while the client was away
+		return;
+	}
+	
+	oldest = h->msgs[h->head]->seq;
+	if( last_seq + 1 < oldest )
+	{
+		send_message(clients, slot, "Server: some messages were lost while you were away");
+		last_seq = oldest - 1;
+	}
+	
+	first = h->count - (h->next_seq - 1 - last_seq);
+	for( i = first; i < h->count && !(clients->flags[slot] & CF_OFFLINE); ++i )
+	{
+		buf = h->msgs[(h->head + i) % HISTORY_LEN];
+		// the client never received its own messages, it does not need them now either
+		if( !memcmp(buf->sender, token, TOKEN_LEN) )
+		{
+			continue;
+		}
+		send_shared(clients, slot, buf);
+	}
+	
+	return;
+}
+
+void new_session_token(unsigned char *token)
+{
+	// an all zero token means "no session", draw again in the unlikely case we get one
+	do
+	{
+		if( getrandom(token, TOKEN_LEN, 0) != TOKEN_LEN )
+		{
+			die_error("session token");
+		}
+	} while( token[0] == 0 && !memcmp(token, token + 1, TOKEN_LEN - 1) );
+	
+	return;
+}
+
+/*
+ * return value: slot of the session owning token, -1 if there is none; the slot may still
+ * have a connection the server did not see die (a network blip without a reset)
+*/
+int find_session(client_table *clients, const unsigned char *token)
+{
+	int i;
+	for( i = 0; i < clients->nb; ++i )
+	{
+		if( !(clients->flags[i] & (CF_KICKED | CF_QUIT)) && !memcmp(clients->info[i].token, token, TOKEN_LEN) )
+		{
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+// tell a client the token to present when it reconnects
+void send_session(client_table *clients, int slot, int resumed)
+{
+	unsigned char payload[TOKEN_LEN + 1];
+	
+	memcpy(payload, clients->info[slot].token, TOKEN_LEN);
+	payload[TOKEN_LEN] = resumed;
+	send_frame_to_client(clients, slot, FRAME_SESSION, (char *)payload, sizeof(payload));
+	
+	return;
+}
+
+/*
+ * @params
+ * r: the ring, the caller must be its only producer
+ * return value: 0, -1 if the ring is full
+*/
+int ptr_ring_push(ptr_ring *r, void *p)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if( head - tail == INDEX_JOBS )
+	{
+		return -1;
+	}
+	r->slots[head & (INDEX_JOBS - 1)] = p;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	
+	return 0;
+}
+
+// return value: the oldest pointer of the ring, NULL if it is empty
+void *ptr_ring_pop(ptr_ring *r)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if( tail == head )
+	{
+		return NULL;
+	}
+	void *p = r->slots[tail & (INDEX_JOBS - 1)];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	
+	return p;
+}
+
+/*
+ * cut the next word out of *text: letters, digits and anything not ASCII (UTF-8),
+ * lowercased and at most TERM_MAX bytes
+ * return value: length of the term written to term, 0 when there are no more words
+*/
+int next_term(const char **text, char *term)
+{
+	const unsigned char *c = (const unsigned char *)*text;
+	int len = 0;
+	
+	while( *c != '\0' && !(isalnum(*c) || *c >= 0x80) )
+	{
+		c++;
+	}
+	while( *c != '\0' && (isalnum(*c) || *c >= 0x80) )
+	{
+		if( len < TERM_MAX )
+		{
+			term[len++] = tolower(*c);
+		}
+		c++;
+	}
+	term[len] = '\0';
+	*text = (const char *)c;
+	
+	return len;
+}
+
+/*
+ * the term of an author: '@' and the whole pseudo lowercased, up to a space or TERM_MAX bytes
+ * so that "jean-lu" is found as "@jean-lu" and not mixed up with "jean"
+ * return value: length of the term written to term, 0 if the pseudo is empty
+*/
+int author_term(const char *pseudo, char *term)
+{
+	int len = 0;
+	
+	while( len < TERM_MAX && pseudo[len] != '\0' && pseudo[len] != ' ' )
+	{
+		term[len + 1] = tolower((unsigned char)pseudo[len]);
+		len++;
+	}
+	if( len == 0 )
+	{
+		term[0] = '\0';
+		return 0;
+	}
+	term[0] = '@';
+	term[len + 1] = '\0';
+	
+	return len + 1;
+}
+
+uint32_t term_hash(const char *term, int len)
+{
+	uint32_t h = 2166136261u;
+	int i;
+	for( i = 0; i < len; ++i )
+	{
+		h = (h ^ (unsigned char)term[i]) * 16777619u;
+	}
+	
+	return h;
+}
+
+/*
+ * @params
+ * create: add the term to the segment if it is not there yet
+ * return value: the posting of the term, NULL if it is not in the segment
+*/
+posting *segment_lookup(index_segment *seg, const char *term, int len, int create)
+{
+	uint32_t hash = term_hash(term, len), i;
+	posting *p;
+	
+	for( i = hash & (seg->table_size - 1); ; i = (i + 1) & (seg->table_size - 1) )
+	{
+		p = &seg->table[i];
+		if( p->term == NULL )
+		{
+			break;
+		}
+		if( p->hash == hash && !strcmp(p->term, term) )
+		{
+			return p;
+		}
+	}
+	if( !create )
+	{
+		return NULL;
+	}
+	
+	p->term = strndup(term, len);
+	if( p->term == NULL )
+	{
+		die_error("index term");
+	}
+	p->hash = hash;
+	seg->nb_terms += 1;
+	seg->bytes += len + 1;
+	
+	return p;
+}
+
+// double the term table of a segment once it is half full
+void segment_grow(index_segment *seg)
+{
+	posting *old = seg->table;
+	uint32_t old_size = seg->table_size, i, j;
+	
+	seg->table_size = old_size * 2;
+	seg->table = calloc(seg->table_size, sizeof(posting));
+	if( seg->table == NULL )
+	{
+		die_error("index table");
+	}
+	for( i = 0; i < old_size; ++i )
+	{
+		if( old[i].term == NULL )
+		{
+			continue;
+		}
+		j = old[i].hash & (seg->table_size - 1);
+		while( seg->table[j].term != NULL )
+		{
+			j = (j + 1) & (seg->table_size - 1);
+		}
+		seg->table[j] = old[i];
+	}
+	free(old);
+	seg->bytes += old_size * sizeof(posting);
+	
+	return;
+}
+
+// append message number n to the posting list of a term, once per message
+void posting_add(index_segment *seg, const char *term, int len, uint32_t n)
+{
+	if( (seg->nb_terms + 1) * 2 > seg->table_size )
+	{
+		segment_grow(seg);
+	}
+	
+	posting *p = segment_lookup(seg, term, len, 1);
+	if( p->next == n + 1 )
+	{
+		// the word appears twice in the same message
+		return;
+	}
+	if( p->len + 5 > p->cap )
+	{
+		uint32_t cap = p->cap == 0 ? 8 : p->cap * 2;
+		unsigned char *grown = realloc(p->list, cap);
+		if( grown == NULL )
+		{
+			die_error("index posting");
+		}
+		seg->bytes += cap - p->cap;
+		p->list = grown;
+		p->cap = cap;
+	}
+	
+	// store the gap to the previous message, small gaps take a single byte
+	uint32_t gap = n + 1 - p->next;
+	while( gap >= 0x80 )
+	{
+		p->list[p->len++] = (gap & 0x7f) | 0x80;
+		gap >>= 7;
+	}
+	p->list[p->len++] = gap;
+	p->next = n + 1;
+	p->count += 1;
+	
+	return;
+}
+
+index_segment *segment_new(void)
+{
+	index_segment *seg = calloc(1, sizeof(index_segment));
+	if( seg == NULL )
+	{
+		die_error("index segment");
+	}
+	seg->table_size = 1024;
+	seg->table = calloc(seg->table_size, sizeof(posting));
+	if( seg->table == NULL )
+	{
+		die_error("index table");
+	}
+	seg->bytes = sizeof(index_segment) + seg->table_size * sizeof(posting);
+	
+	return seg;
+}
+
+// a full segment never changes again: give back what its growing buffers reserved
+void segment_compact(index_segment *seg)
+{
+	uint32_t i;
+	posting *p;
+	char *text;
+	
+	for( i = 0; i < seg->table_size; ++i )
+	{
+		p = &seg->table[i];
+		if( p->term == NULL || p->len == p->cap )
+		{
+			continue;
+		}
+		unsigned char *list = realloc(p->list, p->len);
+		if( list != NULL )
+		{
+			seg->bytes -= p->cap - p->len;
+			p->list = list;
+			p->cap = p->len;
+		}
+	}
+	
+	text = realloc(seg->text, seg->offsets[seg->count]);
+	if( text != NULL )
+	{
+		seg->bytes -= seg->text_cap - seg->offsets[seg->count];
+		seg->text = text;
+		seg->text_cap = seg->offsets[seg->count];
+	}
+	
+	return;
+}
+
+void segment_free(index_segment *seg)
+{
+	uint32_t i;
+	for( i = 0; i < seg->table_size; ++i )
+	{
+		free(seg->table[i].term);
+		free(seg->table[i].list);
+	}
+	free(seg->table);
+	free(seg->text);
+	free(seg);
+	
+	return;
+}
+
+/*
+ * index thread: add a chat message ("pseudo: text") to the newest segment,
+ * its author is indexed as the term @pseudo
+*/
+void index_add(search_index *idx, index_job *job)
+{
+	index_segment *seg = idx->newest;
+	char term[TERM_MAX + 2];
+	const char *c;
+	uint32_t n;
+	int len;
+	
+	// a segment only goes away as a whole, what it holds must stay small next to the budget
+	if( seg == NULL || seg->count == INDEX_SEGMENT_LEN || seg->bytes - sizeof(index_segment) > idx->budget / INDEX_SEGMENT_SHARE )
+	{
+		if( seg != NULL )
+		{
+			size_t full = seg->bytes;
+			segment_compact(seg);
+			idx->bytes -= full - seg->bytes;
+		}
+		seg = segment_new();
+		seg->older = idx->newest;
+		idx->newest = seg;
+		idx->nb_segments += 1;
+		idx->bytes += seg->bytes;
+	}
+	size_t before = seg->bytes;
+	
+	n = seg->count;
+	if( seg->offsets[n] + job->len + 1 > seg->text_cap )
+	{
+		size_t cap = seg->text_cap == 0 ? 65536 : seg->text_cap * 2;
+		while( cap < seg->offsets[n] + job->len + 1 )
+		{
+			cap *= 2;
+		}
+		char *text = realloc(seg->text, cap);
+		if( text == NULL )
+		{
+			die_error("index text");
+		}
+		seg->bytes += cap - seg->text_cap;
+		seg->text = text;
+		seg->text_cap = cap;
+	}
+	memcpy(seg->text + seg->offsets[n], job->text, job->len + 1);
+	seg->offsets[n + 1] = seg->offsets[n] + job->len + 1;
+	seg->seqs[n] = job->seq;
+	seg->count = n + 1;
+	
+	// the author comes from the session, the text is whatever the client typed
+	len = author_term(job->author, term);
+	if( len > 0 )
+	{
+		posting_add(seg, term, len, n);
+	}
+	c = job->text;
+	len = strlen(job->author);
+	if( !strncmp(c, job->author, len) && !strncmp(c + len, ": ", 2) )
+	{
+		c += len + 2;
+	}
+	while( (len = next_term(&c, term)) > 0 )
+	{
+		posting_add(seg, term, len, n);
+	}
+	idx->bytes += seg->bytes - before;
+	
+	// stay within the budget by forgetting the oldest messages, never the segment being filled
+	while( idx->bytes > idx->budget && idx->nb_segments > 1 )
+	{
+		index_segment **oldest = &idx->newest;
+		while( (*oldest)->older != NULL )
+		{
+			oldest = &(*oldest)->older;
+		}
+		idx->bytes -= (*oldest)->bytes;
+		segment_free(*oldest);
+		*oldest = NULL;
+		idx->nb_segments -= 1;
+	}
+	
+	return;
+}
+
+/*
+ * write the message numbers of a posting list to ids, sorted
+ * return value: number of ids, the count of the list
+*/
+uint32_t posting_decode(posting *p, uint32_t *ids)
+{
+	uint32_t nb_ids = 0, pos = 0, value = 0, gap;
+	int shift;
+	
+	while( pos < p->len )
+	{
+		gap = 0;
+		shift = 0;
+		do
+		{
+			gap |= (uint32_t)(p->list[pos] & 0x7f) << shift;
+			shift += 7;
+		} while( p->list[pos++] & 0x80 );
+		value += gap;
+		// value is the message number plus one
+		ids[nb_ids++] = value - 1;
+	}
+	
+	return nb_ids;
+}
+
+/*
+ * keep in ids (sorted message numbers) only the ones that are in the posting list
+ * return value: number of ids left
+*/
+uint32_t posting_filter(posting *p, uint32_t *ids, uint32_t nb_ids)
+{
+	uint32_t i = 0, kept = 0, pos = 0, value = 0, gap;
+	int shift;
+	
+	while( pos < p->len && i < nb_ids )
+	{
+		gap = 0;
+		shift = 0;
+		do
+		{
+			gap |= (uint32_t)(p->list[pos] & 0x7f) << shift;
+			shift += 7;
+		} while( p->list[pos++] & 0x80 );
+		value += gap;
+		
+		// value is the message number plus one
+		while( i < nb_ids && ids[i] + 1 < value )
+		{
+			i++;
+		}
+		if( i < nb_ids && ids[i] + 1 == value )
+		{
+			ids[kept++] = ids[i++];
+		}
+	}
+	
+	return kept;
+}
+
+/*
+ * index thread: run "/search [from:pseudo] [words]", every word and the author must match
+ * return value: the answer to send back
+*/
+index_answer *index_search(search_index *idx, index_job *job, uint32_t *ids)
+{
+	char terms[SEARCH_TERMS][TERM_MAX + 2];
+	int nb_terms = 0, len, shown = 0, i, smallest;
+	posting *postings[SEARCH_TERMS];
+	const char *c = job->text + strlen(SEARCH);
+	unsigned long matches = 0;
+	struct timespec start, end;
+	index_segment *seg;
+	uint32_t nb_ids, k;
+	size_t used;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	index_answer *answer = malloc(sizeof(index_answer) + MAX_PAYLOAD + 1);
+	if( answer == NULL )
+	{
+		die_error("search answer");
+	}
+	memcpy(answer->token, job->token, TOKEN_LEN);
+	
+	while( *c == ' ' )
+	{
+		c++;
+	}
+	if( !strncmp(c, "from:", 5) )
+	{
+		c += 5;
+		if( author_term(c, terms[0]) > 0 )
+		{
+			nb_terms = 1;
+		}
+		while( *c != '\0' && *c != ' ' )
+		{
+			c++;
+		}
+	}
+	while( nb_terms < SEARCH_TERMS && next_term(&c, terms[nb_terms]) > 0 )
+	{
+		nb_terms++;
+	}
+	if( nb_terms == 0 )
+	{
+		answer->len = sprintf(answer->text, "Server: usage %s [from:pseudo] [words]", SEARCH);
+		return answer;
+	}
+	
+	// reserve room for the summary line, written once the matches are counted
+	used = 128;
+	for( seg = idx->newest; seg != NULL; seg = seg->older )
+	{
+		smallest = 0;
+		for( i = 0; i < nb_terms; ++i )
+		{
+			postings[i] = segment_lookup(seg, terms[i], strlen(terms[i]), 0);
+			if( postings[i] == NULL )
+			{
+				break;
+			}
+			if( postings[i]->count < postings[smallest]->count )
+			{
+				smallest = i;
+			}
+		}
+		if( i < nb_terms )
+		{
+			// a term never appears in this segment
+			continue;
+		}
+		
+		// start from the rarest term and intersect the others with it
+		nb_ids = posting_decode(postings[smallest], ids);
+		for( i = 0; i < nb_terms && nb_ids > 0; ++i )
+		{
+			if( i != smallest )
+			{
+				nb_ids = posting_filter(postings[i], ids, nb_ids);
+			}
+		}
+		matches += nb_ids;
+		
+		// newest first
+		for( k = nb_ids; k > 0 && shown < SEARCH_RESULTS && used < MAX_PAYLOAD - MAX_BUFF; --k )
+		{
+			len = snprintf(answer->text + used, MAX_BUFF, "\n#%lu %s", (unsigned long)seg->seqs[ids[k - 1]], seg->text + seg->offsets[ids[k - 1]]);
+			used += len < MAX_BUFF ? len : MAX_BUFF - 1;
+			shown++;
+		}
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	len = snprintf(answer->text, 128, "Server: %lu messages match, newest %d shown (%ld us over %d segments)",
+			matches, shown, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000, idx->nb_segments);
+	if( len > 127 )
+	{
+		len = 127;
+	}
+	// slide the matches up against the summary
+	memmove(answer->text + len, answer->text + 128, used - 128);
+	answer->len = len + used - 128;
+	answer->text[answer->len] = '\0';
+	
+	return answer;
+}
+
+void *index_thread(void *arg)
+{
+	search_index *idx = arg;
+	struct timespec busy = { 0, INDEX_RETRY_NS };
+	uint32_t *ids = malloc(INDEX_SEGMENT_LEN * sizeof(uint32_t));
+	index_answer *answer;
+	index_job *job;
+	uint64_t one = 1;
+	
+	if( ids == NULL )
+	{
+		die_error("search buffer");
+	}
+	
+	for( ;; )
+	{
+		job = ptr_ring_pop(&idx->jobs);
+		if( job == NULL )
+		{
+			idle_wait(&idx->sleeping, idx->wake_efd, &idx->jobs.head, atomic_load_explicit(&idx->jobs.tail, memory_order_relaxed));
+			continue;
+		}
+		
+		if( job->seq != 0 )
+		{
+			index_add(idx, job);
+		}
+		else
+		{
+			answer = index_search(idx, job, ids);
+			// the event loop never waits for us, we can wait for it
+			while( ptr_ring_push(&idx->answers, answer) == -1 )
+			{
+				nanosleep(&busy, NULL);
+			}
+			if( write(idx->efd, &one, sizeof(one)) == -1 )
+			{
+				die_error("search wake up");
+			}
+		}
+		free(job);
+	}
+	
+	return NULL;
+}
+
+/*
+ * @params
+ * budget_mb: memory the index may use, 0 disables /search
+*/
+void index_start(search_index *idx, size_t budget_mb)
+{
+	if( budget_mb == 0 )
+	{
+		return;
+	}
+	idx->budget = budget_mb << 20;
+	idx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	idx->wake_efd = eventfd(0, EFD_CLOEXEC);
+	if( idx->efd == -1 || idx->wake_efd == -1 )
+	{
+		die_error("search eventfd");
+	}
+	if( pthread_create(&idx->thread, NULL, index_thread, idx) != 0 )
+	{
+		die_error("index thread");
+	}
+	idx->running = 1;
+	
+	return;
+}
+
+/*
+ * event loop: hand a chat message over to the index thread
+ * author: pseudo of the sender, indexed as @author
+ * text: "pseudo: text" as broadcast, len bytes, only the first MAX_BUFF are indexed
+ * (a search shows no more than that of a match, and the queued jobs stay small)
+*/
+void index_message(search_index *idx, uint64_t seq, const char *author, const char *text, size_t len)
+{
+	if( !idx->running )
+	{
+		return;
+	}
+	if( len > MAX_BUFF )
+	{
+		len = MAX_BUFF;
+	}
+	
+	index_job *job = malloc(sizeof(index_job) + len + 1);
+	if( job == NULL )
+	{
+		die_error("index job");
+	}
+	job->seq = seq;
+	size_t author_len = strnlen(author, PSEUDO_LEN);
+	memcpy(job->author, author, author_len);
+	job->author[author_len] = '\0';
+	job->len = len;
+	memcpy(job->text, text, len);
+	job->text[len] = '\0';
+	if( ptr_ring_push(&idx->jobs, job) == -1 )
+	{
+		// the index thread is behind, losing a message from the index beats stalling the chat
+		free(job);
+		atomic_fetch_add_explicit(&idx->dropped, 1, memory_order_relaxed);
+	}
+	else if( idle_wake(&idx->sleeping, idx->wake_efd) == -1 )
+	{
+		log_errno(LOG_WARN, "index wake up");
+	}
+	
+	return;
+}
+
+// event loop: queue a /search for the client in slot, the answer comes back through index_deliver()
+void index_query(search_index *idx, client_table *clients, int slot, const char *query, size_t len)
+{
+	const char *refused = NULL;
+	
+	if( !idx->running )
+	{
+		refused = "Server: search is disabled";
+	}
+	else
+	{
+		if( len > MAX_BUFF )
+		{
+			len = MAX_BUFF;
+		}
+		index_job *job = malloc(sizeof(index_job) + len + 1);
+		if( job == NULL )
+		{
+			die_error("search job");
+		}
+		job->seq = 0;
+		memcpy(job->token, clients->info[slot].token, TOKEN_LEN);
+		job->len = len;
+		memcpy(job->text, query, len);
+		job->text[len] = '\0';
+		if( ptr_ring_push(&idx->jobs, job) == -1 )
+		{
+			free(job);
+			refused = "Server: search is busy, try again";
+		}
+		else if( idle_wake(&idx->sleeping, idx->wake_efd) == -1 )
+		{
+			log_errno(LOG_WARN, "index wake up");
+		}
+	}
+	
+	if( refused != NULL )
+	{
+		send_message(clients, slot, refused);
+	}
+	
+	return;
+}
+
+// event loop: send the answers the index thread has finished to whoever asked
+void index_deliver(search_index *idx, client_table *clients)
+{
+	index_answer *answer;
+	uint64_t wakeups;
+	unsigned long dropped;
+	int slot;
+	
+	if( read(idx->efd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN )
+	{
+		log_errno(LOG_WARN, "search wake up");
+	}
+	
+	while( (answer = ptr_ring_pop(&idx->answers)) != NULL )
+	{
+		// the slot may have moved or gone while the search ran
+		for( slot = 0; slot < clients->nb; ++slot )
+		{
+			if( !(clients->flags[slot] & CF_OFFLINE) && !memcmp(clients->info[slot].token, answer->token, TOKEN_LEN) )
+			{
+				send_frame_to_client(clients, slot, FRAME_TEXT, answer->text, answer->len);
+				break;
+			}
+		}
+		free(answer);
+	}
+	
+	dropped = atomic_exchange_explicit(&idx->dropped, 0, memory_order_relaxed);
+	if( dropped > 0 )
+	{
+		log_int(LOG_WARN, "%ld chat messages left out of the search index (queue full)", dropped);
+	}
+	
+	return;
+}
+
+/*
+ * give a reconnecting client its detached slot back: no join notice, no welcome,
+ * only the chat messages it missed are replayed
+*/
+void resume_client(client_table *clients, int slot, int sock, client_info *ci, int family)
+{
+	if( clients->fd[slot] != -1 )
+	{
+		// the client gave up on a connection we still believed in, it is the same session
+		log_str(LOG_INFO, "%s came back before its old connection was seen dead, dropping it", clients->info[slot].pseudo);
+		zc_close(clients, slot);
+		shm_release(clients, slot);
+		free(clients->rx[slot].buf);
+	}
+	clients->fd[slot] = sock;
+	// keep what the session was (visibility, rights, pseudo), forget the old connection
+	clients->flags[slot] &= CF_INVISIBLE | CF_ADMINISTRATOR;
+	memset(&clients->rx[slot], 0, sizeof(client_rx));
+	clients->info[slot].caps = ci->caps;
+	clients->info[slot].dict_id = ci->dict_id;
+	strcpy(clients->info[slot].ip, ci->ip);
+	strcpy(clients->info[slot].port, ci->port);
+	zc_enable(clients, slot);
+	if( ci->caps & CAP_SHM )
+	{
+		shm_offer(clients, slot, family);
+	}
+	compress_enable(clients, slot, family);
+	send_session(clients, slot, 1);
+	log_str_int(LOG_INFO, "%s resumed from sequence %ld", clients->info[slot].pseudo, ci->resume_seq);
+	
+	history_resume(&backlog, clients, slot, ci->resume_seq);
+	
+	return;
+}
+
+/*
+ * accept a visitor on a listener, its handshake is then collected by handshake_read()
+ * as it arrives so that a slow or silent visitor never holds the event loop up
+ * max_fd: highest socket in select
+*/
+void accept_client(int server_socket, int *max_fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	struct timespec now;
+	handshake *hs;
+	
+	int sock = accept4(server_socket, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK);
+	if( sock == -1 )
+	{
+		log_errno(LOG_WARN, "add client");
+		return;
+	}
+	if( sock >= FD_SETSIZE )
+	{
+		log_msg(LOG_WARN, "Too many open connections for select, refusing a visitor");
+		close(sock);
+		return;
+	}
+	if( nb_handshakes == HANDSHAKE_MAX )
+	{
+		log_msg(LOG_WARN, "Too many visitors in the middle of their handshake, refusing one");
+		close(sock);
+		return;
+	}
+	
+	hs = &handshakes[nb_handshakes++];
+	memset(hs, 0, sizeof(handshake));
+	hs->fd = sock;
+	hs->family = addr.ss_family;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	hs->since = now.tv_sec;
+	if( addr.ss_family == AF_UNIX )
+	{
+		strcpy(hs->ci.ip, "local");
+	}
+	else
+	{
+		getnameinfo((struct sockaddr *)&addr, addrlen, hs->ci.ip, sizeof(hs->ci.ip), hs->ci.port, sizeof(hs->ci.port), NI_NUMERICHOST | NI_NUMERICSERV);
+	}
+	if( *max_fd < sock )
+	{
+		*max_fd = sock;
+	}
+	
+	return;
+}
+
+/*
+ * read what arrived of the handshake of a visitor and admit it once it is complete
+ * return value: 1 when the visitor is done with (admitted, resumed or refused), 0 if more is expected
+*/
+int handshake_read(client_table *clients, handshake *hs)
 {
-	// recv pseudo first
-	memset(&ci->pseudo, 0, PSEUDO_LEN);
-	int bytes_recvd = recv(ci->sock, ci->pseudo, PSEUDO_LEN, 0);
-	if( bytes_recvd == -1 )
+	ssize_t bytes_recvd = recv(hs->fd, hs->buf + hs->len, HANDSHAKE_LEN - hs->len, MSG_DONTWAIT);
+	if( bytes_recvd == 0 )
 	{
-		die_error("recv client info - pseudo");
+		log_str(LOG_WARN, "%s left before the end of its handshake", hs->ci.ip);
+		close(hs->fd);
+		return 1;
 	}
-	fprintf(stderr, "pseudo: %s\n", ci->pseudo);
-	
-	// recv client type - administrator, regular, ..
-	bytes_recvd = recv(ci->sock, &(ci->type), sizeof(ci->type), 0);
-	if( bytes_recvd == -1 )
+	if( bytes_recvd == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
 	{
-		die_error("recv client info - type");
+		log_errno(LOG_WARN, "recv client info");
+		close(hs->fd);
+		return 1;
 	}
-	// check type in case of connection error and receiving incorrect data
-	// if more user types are added, they need to be checked here
-	if( ci->type != REGULAR && ci->type != ADMINISTRATOR )
+	if( bytes_recvd > 0 )
 	{
-		fprintf(stderr, "error in connection - type\n");
-		return -1;
+		hs->len += bytes_recvd;
 	}
-	fprintf(stderr, "type is %d\n", ci->type);
-	
-	// recv client status - visible, invisible, ..
-	bytes_recvd = recv(ci->sock, &(ci->status), sizeof(ci->status), 0);
-	if( bytes_recvd == -1 )
+	if( hs->len < HANDSHAKE_LEN )
 	{
-		die_error("recv client info - status");
+		return 0;
 	}
-	if( ci->status != VISIBLE && ci->status != INVISIBLE )
+	
+	// from now on the connection is a client like the others, whose sends block
+	int fl = fcntl(hs->fd, F_GETFL);
+	if( parse_client_info(hs->buf, &hs->ci) == -1 || fl == -1 || fcntl(hs->fd, F_SETFL, fl & ~O_NONBLOCK) == -1 )
 	{
-		fprintf(stderr, "error in connection - status\n");
-		return -1;
+		close(hs->fd);
+		return 1;
 	}
-	fprintf(stderr, "status is %d\n", ci->status);
+	admit_client(clients, hs->fd, &hs->ci, hs->family);
 	
-	return 0;
+	return 1;
 }
 
-void send_message(int sock, const char *msg)
+/*
+ * give up on the visitors that did not finish their handshake in time
+ * return value: number of handshakes still in progress
+*/
+int handshake_sweep(time_t now)
 {
-	int bytes_sent = send(sock, msg, strlen(msg), 0);
-	if( bytes_sent == -1 )
+	int k;
+	for( k = nb_handshakes - 1; k >= 0; --k )
 	{
-		die_error("send message");
+		if( now - handshakes[k].since >= HANDSHAKE_TIMEOUT )
+		{
+			log_str(LOG_WARN, "%s did not finish its handshake in time", handshakes[k].ci.ip);
+			close(handshakes[k].fd);
+			handshakes[k] = handshakes[--nb_handshakes];
+		}
 	}
 	
-	return;
+	return nb_handshakes;
 }
 
 /*
  * @params
- * clients_list: the client list
- * server_socket: server socket (used for accept()'ing connections)
- * nb_clients: total number of clients
- * max_fd: highest socket in select
+ * clients: the client table
+ * sock: connection of a client whose handshake is complete
+ * info: what its handshake said
+ * family: address family of the listener it came through
+ * return value: slot of the client that joined or resumed its session, -1 on error
 */
-int add_client_to_list(client_info *clients_list, int server_socket, int *nb_clients, int *max_fd)
+int admit_client(client_table *clients, int sock, client_info *info, int family)
 {
 	char *welcome_message = calloc(MAX_BUFF * 3, sizeof(char));
-	client_info ci;
+	char joined[MAX_BUFF];
+	client_info ci = *info;
 	
-	memset(ci.ip, '\0', INET6_ADDRSTRLEN);
-	memset(ci.ip, '\0', 5);
-	ci.sock = accept(server_socket, NULL, NULL);
-	if( ci.sock == -1 )
+	int cur = find_session(clients, ci.token);
+	if( cur > -1 )
 	{
-		perror("add client");
-		return -1;
+		resume_client(clients, cur, sock, &ci, family);
+		free(welcome_message);
+		return cur;
 	}
 	
-	int res = recv_client_info(&ci);
-	if( res == -1 )
+	if( clients->nb == clients->cap )
 	{
+		// only a resumption could still get in
+		log_msg(LOG_WARN, "We don't have any more space to welcome visitors");
+		close(sock);
+		free(welcome_message);
 		return -1;
 	}
 	
-	int cur = *nb_clients;
-	clients_list[cur] = ci;
+	cur = clients->nb;
+	clients->fd[cur] = sock;
+	clients->flags[cur] = (ci.status == INVISIBLE ? CF_INVISIBLE : 0) | (ci.type == ADMINISTRATOR ? CF_ADMINISTRATOR : 0);
+	clients->zc[cur] = NULL;
+	clients->shm[cur] = NULL;
+	memset(&clients->rx[cur], 0, sizeof(client_rx));
+	clients->info[cur] = ci;
+	new_session_token(clients->info[cur].token);
+	zc_enable(clients, cur);
+	clients->nb = cur + 1;
+	if( ci.caps & CAP_SHM )
+	{
+		// must be the first frame the client reads, it tells where the following ones go
+		shm_offer(clients, cur, family);
+	}
+	compress_enable(clients, cur, family);
+	send_session(clients, cur, 0);
 	// debug line
-	print_client_info(&clients_list[cur]);
+	print_client_info(sock, &clients->info[cur]);
 	// send client welcome message
 	strncat(welcome_message, etoiles, strlen(etoiles));
 	strncat(welcome_message, "\n", 1);
@@ -147,80 +2647,142 @@ int add_client_to_list(client_info *clients_list, int server_socket, int *nb_cli
 	strncat(welcome_message, ci.pseudo, strlen(ci.pseudo));
 	strcat(welcome_message, " - to the chat of Nantes University\t*\n");
 	strncat(welcome_message, etoiles, strlen(etoiles));
-	send_message(ci.sock, welcome_message);
+	send_message(clients, cur, welcome_message);
+	free(welcome_message);
+	
+	// catch the newcomer up with the conversation
+	history_send_replay(&backlog, clients, cur);
 	
-	cur += 1;
-	*nb_clients = cur;
-	if( *max_fd < ci.sock )
+	snprintf(joined, MAX_BUFF, "Server: [%s] has joined the chat", clients->info[cur].pseudo);
+	if( !(clients->flags[cur] & (CF_INVISIBLE | CF_OFFLINE)) )
 	{
-		*max_fd = ci.sock;
+		send_notice_to_all_clients(clients, joined, cur);
 	}
 	
-	return (cur - 1);				// last person that joined
+	return cur;					// last person that joined
+}
+
+// close the connection of a client but keep its slot for a while so it can resume its session
+void detach_client(client_table *clients, int slot)
+{
+	struct timespec now;
+	
+	zc_close(clients, slot);
+	shm_release(clients, slot);
+	free(clients->rx[slot].buf);
+	memset(&clients->rx[slot], 0, sizeof(client_rx));
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	clients->info[slot].detached_at = now.tv_sec;
+	clients->flags[slot] = (clients->flags[slot] & (CF_INVISIBLE | CF_ADMINISTRATOR)) | CF_DETACHED;
+	log_str(LOG_INFO, "%s lost its connection, keeping the session", clients->info[slot].pseudo);
+	
+	return;
 }
 
 /*
  * @params
- * clients: list of clients
- * to_remove: the client to remove
- * nb_clients: number of clients, this parameter is modified
+ * clients: the client table
+ * to_remove: the slot to free, the last client is moved into it
 */
-void remove_client_from_list(client_info *clients, int to_remove, int *nb_clients)
+void remove_client_from_list(client_table *clients, int to_remove)
 {
-	close(clients[to_remove].sock);
-	// need to modify the clients list since we have removed a client
-	int i, total = *nb_clients - 1;
-	for( i = to_remove; i < total; ++i )
+	zc_close(clients, to_remove);
+	shm_release(clients, to_remove);
+	free(clients->rx[to_remove].buf);
+	// keep the hot arrays packed: move the last client into the hole instead of shifting everyone,
+	// which is why /list is not in joining order once somebody has left
+	int last = clients->nb - 1;
+	if( to_remove != last )
 	{
-		clients[i] = clients[i + 1];
+		clients->fd[to_remove] = clients->fd[last];
+		clients->flags[to_remove] = clients->flags[last];
+		clients->zc[to_remove] = clients->zc[last];
+		clients->shm[to_remove] = clients->shm[last];
+		clients->rx[to_remove] = clients->rx[last];
+		clients->info[to_remove] = clients->info[last];
 	}
-	*nb_clients = total;
+	clients->nb = last;
 	
 	return;
 }
 
-int recv_message(int csock, char *out_buffer, int size)
-{
-	return recv(csock, out_buffer, size, 0);
-}
-
 /*
- * @params
- * clients: clients list
- * exclude: don't send to this client
+ * handle the clients whose state changed during this loop iteration: lost connections
+ * are detached, clients that quit or were kicked out and expired sessions are removed
+ * removals are deferred so slots never move while messages are being handled
+ * return value: seconds until the next detached session expires, -1 if there is none
 */
-void send_to_all_clients(client_info *clients, int nb_clients, char *message, int exclude)
+long sweep_clients(client_table *clients)
 {
-	int i = 0;
-	for( i = 0; i < nb_clients; ++i )
+	char left[MAX_BUFF];
+	int i, visible;
+	long next_expiry = -1, remaining;
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for( i = clients->nb - 1; i >= 0; --i )
 	{
-		if( i != exclude )
+		if( (clients->flags[i] & CF_CLOSING) && !(clients->flags[i] & (CF_QUIT | CF_KICKED)) )
+		{
+			detach_client(clients, i);
+		}
+		
+		if( clients->flags[i] & CF_DETACHED )
+		{
+			remaining = clients->info[i].detached_at + RESUME_GRACE - now.tv_sec;
+			if( remaining > 0 )
+			{
+				if( next_expiry == -1 || remaining < next_expiry )
+				{
+					next_expiry = remaining;
+				}
+				continue;
+			}
+			log_str(LOG_INFO, "session of %s expired", clients->info[i].pseudo);
+		}
+		else if( !(clients->flags[i] & (CF_QUIT | CF_KICKED)) )
 		{
-			send_message(clients[i].sock, message);
+			continue;
+		}
+		
+		// nobody is told when someone gets kicked out
+		visible = !(clients->flags[i] & (CF_INVISIBLE | CF_KICKED));
+		snprintf(left, MAX_BUFF, "Server: [%s] has left the chat", clients->info[i].pseudo);
+		remove_client_from_list(clients, i);
+		if( visible )
+		{
+			send_notice_to_all_clients(clients, left, -1);
 		}
 	}
 	
-	return;
+	// connections waiting for their zerocopy completions and visitors are looked at every second
+	if( (zc_linger_sweep(now.tv_sec) + handshake_sweep(now.tv_sec)) > 0 && (next_expiry == -1 || next_expiry > 1) )
+	{
+		next_expiry = 1;
+	}
+	
+	return next_expiry;
 }
 
-void send_list_of_clients(int which_socket, client_info *clients, int nb_clients)
+void send_list_of_clients(client_table *clients, int which_client)
 {
 	// try to malloc enough space for pseudos and newlines
-	int names_buffer_len = (nb_clients * PSEUDO_LEN) + (PSEUDO_LEN * 2);
+	int names_buffer_len = (clients->nb * PSEUDO_LEN) + (PSEUDO_LEN * 2);
 	char *names_buffer = calloc(names_buffer_len, sizeof(char));
 	
 	int i;
-	for( i = 0; i < nb_clients; ++i )
+	for( i = 0; i < clients->nb; ++i )
 	{
-		if( clients[i].status == VISIBLE )
+		if( !(clients->flags[i] & (CF_INVISIBLE | CF_GONE)) )
 		{
-			strncat(names_buffer, clients[i].pseudo, strlen(clients[i].pseudo));
+			strncat(names_buffer, clients->info[i].pseudo, strlen(clients->info[i].pseudo));
 			strncat(names_buffer, "\n", 1);
 		}
 	}
 	
 	// send the list of clients
-	send_message(which_socket, names_buffer);
+	send_frame_to_client(clients, which_client, FRAME_LIST, names_buffer, strlen(names_buffer));
 	
 	// no longer needed
 	free(names_buffer);
@@ -255,12 +2817,12 @@ int find_until(char *text, char c)
 
 // find user in list of clients and return index
 // used for sending private messages and kicking out users
-int find_user_index(client_info *clients, int nb_clients, char *pseudo)
+int find_user_index(client_table *clients, char *pseudo)
 {
 	int i, index = -1;
-	for( i = 0; i < nb_clients; ++i )
+	for( i = 0; i < clients->nb; ++i )
 	{
-		if( !strncmp(clients[i].pseudo, pseudo, strlen(clients[i].pseudo)) )
+		if( !strncmp(clients->info[i].pseudo, pseudo, strlen(clients->info[i].pseudo)) )
 		{
 			// found the pseudo
 			index = i;
@@ -270,13 +2832,420 @@ int find_user_index(client_info *clients, int nb_clients, char *pseudo)
 	return index;
 }
 
+/*
+ * answer to /trace: one csv line per stage of the traced chat messages
+ * return value: length written to out
+*/
+int stage_report(char *out, size_t size)
+{
+	return stage_format(out, size, "Server: ", stage_names, trace_stats, TRACE_STAGES);
+}
+
+/*
+ * @params
+ * clients: the client table
+ * i: the client that sent the message
+ * message_buf: NUL terminated payload of a FRAME_TEXT frame
+ * len: payload length
+ * tr: stamps of a traced message, they came right before message_buf; NULL if not traced
+*/
+void handle_message(client_table *clients, int i, char *message_buf, size_t len, trace_stamps *tr)
+{
+	// compare the message with special command
+	if( !strcmp(message_buf, QUIT) )
+	{
+		// leaving for good, as opposed to a lost connection
+		clients->flags[i] |= CF_QUIT;
+	}
+	else if( !strncmp(message_buf, LIST, strlen(LIST)) )
+	{
+		// list command found
+		send_list_of_clients(clients, i);
+	}
+	else if( !strncmp(message_buf, "@", 1) )
+	{
+		// find index of pseudo if it exists
+		int pseudo_index = find_user_index(clients, message_buf + 1);
+		if( pseudo_index > -1 && !(clients->flags[pseudo_index] & CF_OFFLINE) )
+		{
+			send_frame_to_client(clients, pseudo_index, FRAME_TEXT, message_buf, len);
+		}
+	}
+	else if( !strncmp(message_buf, KICK, strlen(KICK)) && (clients->flags[i] & CF_ADMINISTRATOR) )
+	{
+		int pseudo_index = find_user_index(clients, message_buf + strlen(KICK) + 1);
+		if( pseudo_index > -1 && !(clients->flags[pseudo_index] & CF_GONE) )
+		{
+			const char *kicked_message = "You have been kicked out from the chat";
+			if( !(clients->flags[pseudo_index] & CF_DETACHED) )
+			{
+				send_frame_to_client(clients, pseudo_index, FRAME_KICKED, kicked_message, strlen(kicked_message));
+			}
+			// the session is dropped with the slot, its token cannot be used to come back
+			clients->flags[pseudo_index] |= CF_KICKED;
+		}
+	}
+	else if( !strncmp(message_buf, TRACE, strlen(TRACE)) )
+	{
+		char report[MAX_BUFF * 2];
+		send_frame_to_client(clients, i, FRAME_TEXT, report, stage_report(report, sizeof(report)));
+	}
+	else if( !strncmp(message_buf, SEARCH, strlen(SEARCH)) )
+	{
+		// answered by the index thread, see index_deliver()
+		index_query(&searcher, clients, i, message_buf, len);
+	}
+	else if( !strncmp(message_buf, CHANGE, strlen(CHANGE)) )
+	{
+		char *updated_pseudo_msg = calloc(MAX_BUFF, sizeof(char));
+		client_info *ci = &clients->info[i];
+		
+		strncat(updated_pseudo_msg, ci->pseudo, strlen(ci->pseudo));
+		// change the pseudo and update it in the clients list
+		memset(ci->pseudo, '\0', sizeof(ci->pseudo));
+		strncpy(ci->pseudo, message_buf + strlen(CHANGE) + 1, PSEUDO_LEN);
+		
+		if( !(clients->flags[i] & CF_INVISIBLE) )
+		{
+			// inform on name change if and only if the client is visible to others
+			// send message to all clients informing about the change
+			const char *changed_pseudo = " has changed their pseudo to ";
+			strncat(updated_pseudo_msg, changed_pseudo, strlen(changed_pseudo));
+			strncat(updated_pseudo_msg, ci->pseudo, strlen(ci->pseudo));
+			
+			send_notice_to_all_clients(clients, updated_pseudo_msg, i);
+		}
+		free(updated_pseudo_msg);
+	}
+	else
+	{
+		// framed once, shared by every recipient and kept for the clients joining later
+		shared_buf *buf;
+		if( tr != NULL )
+		{
+			// the stamps travel on to the recipients, in front of the text as they came
+			tr->enqueue = htobe64(monotonic_ns());
+			memcpy(message_buf - sizeof(trace_stamps), tr, sizeof(trace_stamps));
+			buf = shared_buf_frame(FRAME_TRACED, backlog.next_seq, message_buf - sizeof(trace_stamps), sizeof(trace_stamps) + len);
+		}
+		else
+		{
+			buf = shared_buf_frame(FRAME_TEXT, backlog.next_seq, message_buf, len);
+		}
+		memcpy(buf->sender, clients->info[i].token, TOKEN_LEN);
+		send_to_all_clients(clients, buf, i);
+		if( tr != NULL )
+		{
+			uint64_t flushed = monotonic_ns();
+			stage_add(&trace_stats[STAGE_UPLINK], be64toh(tr->send), be64toh(tr->recv), flushed);
+			stage_add(&trace_stats[STAGE_PARSE], be64toh(tr->recv), be64toh(tr->dispatch), flushed);
+			stage_add(&trace_stats[STAGE_HANDLE], be64toh(tr->dispatch), be64toh(tr->enqueue), flushed);
+			stage_add(&trace_stats[STAGE_FANOUT], be64toh(tr->enqueue), flushed, flushed);
+		}
+		history_push(&backlog, buf);
+		shared_buf_unref(buf);
+		index_message(&searcher, backlog.next_seq++, clients->info[i].pseudo, message_buf, len);
+	}
+	
+	return;
+}
+
+/*
+ * read what the client sent and handle every complete frame
+ * return value: -1 if the connection is closed or the client sent garbage, 0 otherwise
+*/
+int client_read(client_table *clients, int i)
+{
+	client_rx *rx = &clients->rx[i];
+	frame_hdr hdr;
+	size_t done = 0, len, need;
+	ssize_t bytes_recvd;
+	trace_stamps stamps;
+	uint64_t recvd_at;
+	char saved;
+	
+	if( rx->buf == NULL )
+	{
+		// most messages are short, the buffer only grows for big payloads
+		rx->cap = sizeof(frame_hdr) + MAX_BUFF;
+		rx->buf = malloc(rx->cap + 1);
+		if( rx->buf == NULL )
+		{
+			die_error("receive buffer");
+		}
+	}
+	
+	bytes_recvd = recv(clients->fd[i], rx->buf + rx->len, rx->cap - rx->len, MSG_DONTWAIT);
+	if( bytes_recvd == 0 )
+	{
+		return -1;
+	}
+	if( bytes_recvd == -1 )
+	{
+		// readable only because of zerocopy notifications on the error queue
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	}
+	rx->len += bytes_recvd;
+	recvd_at = htobe64(monotonic_ns());
+	
+	while( rx->len - done >= sizeof(frame_hdr) )
+	{
+		memcpy(&hdr, rx->buf + done, sizeof(hdr));
+		len = ntohl(hdr.len);
+		if( len > MAX_PAYLOAD )
+		{
+			log_str_int(LOG_WARN, "%s sent a %ld bytes frame, dropping them", clients->info[i].pseudo, len);
+			return -1;
+		}
+		
+		need = sizeof(frame_hdr) + len;
+		if( rx->len - done < need )
+		{
+			if( rx->cap < need )
+			{
+				// large payload on its way, make room for the whole frame
+				char *grown = realloc(rx->buf, need + 1);
+				if( grown == NULL )
+				{
+					die_error("receive buffer");
+				}
+				rx->buf = grown;
+				rx->cap = need;
+			}
+			break;
+		}
+		
+		// commands are parsed as strings, terminate the payload in place
+		char *payload = rx->buf + done + sizeof(frame_hdr);
+		saved = payload[len];
+		payload[len] = '\0';
+		if( ntohl(hdr.type) == FRAME_TEXT )
+		{
+			handle_message(clients, i, payload, len, NULL);
+		}
+		else if( ntohl(hdr.type) == FRAME_TRACED && len >= sizeof(trace_stamps) )
+		{
+			// frames are not aligned in the buffer, work on a copy of the stamps
+			memcpy(&stamps, payload, sizeof(stamps));
+			stamps.recv = recvd_at;
+			stamps.dispatch = htobe64(monotonic_ns());
+			handle_message(clients, i, payload + sizeof(stamps), len - sizeof(stamps), &stamps);
+		}
+		payload[len] = saved;
+		done += need;
+		
+		if( clients->flags[i] & CF_GONE )
+		{
+			return 0;
+		}
+	}
+	
+	// keep the incomplete frame at the front of the buffer
+	memmove(rx->buf, rx->buf + done, rx->len - done);
+	rx->len -= done;
+	
+	return 0;
+}
+
+/*
+ * time the walk of send_to_all_clients() over a table of detached slots
+ * evict: write a buffer larger than the caches before every walk, off the clock
+ * return value: nanoseconds per slot
+*/
+double bench_walk(client_table *clients, shared_buf *buf, char *evict)
+{
+	uint64_t start, elapsed = 0;
+	int r;
+	
+	for( r = 0; r < BENCH_WALKS; ++r )
+	{
+		if( evict != NULL )
+		{
+			memset(evict, r, BENCH_EVICT);
+		}
+		start = monotonic_ns();
+		send_to_all_clients(clients, buf, -1);
+		elapsed += monotonic_ns() - start;
+	}
+	
+	return (double)elapsed / BENCH_WALKS / clients->nb;
+}
+
+/*
+ * -b rounds: time send_to_all_clients(), first the bare walk over the hot arrays of
+ * BENCH_SLOTS detached slots (hot in the caches, then cold), then real sends of a few
+ * message sizes to as many local socket pairs as the descriptor limit allows; the
+ * peers are drained between two rounds, off the clock
+*/
+void fanout_benchmark(int rounds)
+{
+	static char drain[MAX_PAYLOAD];
+	static char payload[16384];
+	size_t sizes[] = { 64, 1024, 16384 };
+	client_table clients;
+	int *peers, pair[2], i, r, k, max_pairs;
+	struct rlimit limit;
+	uint64_t start, elapsed;
+	shared_buf *buf;
+	char *evict;
+	double ns;
+	
+	memset(payload, 'x', sizeof(payload));
+	buf = shared_buf_frame(FRAME_TEXT, 1, payload, sizes[0]);
+	client_table_init(&clients, BENCH_SLOTS);
+	evict = malloc(BENCH_EVICT);
+	if( evict == NULL )
+	{
+		die_error("benchmark buffer");
+	}
+	for( i = 0; i < BENCH_SLOTS; ++i )
+	{
+		clients.fd[i] = -1;
+		clients.flags[i] = CF_DETACHED;
+	}
+	clients.nb = BENCH_SLOTS;
+	ns = bench_walk(&clients, buf, NULL);
+	printf("walk: %d slots in cache, %.2f ns per slot, %.0f MB/s of flags\n", clients.nb, ns, sizeof(clients.flags[0]) * 1000 / ns);
+	ns = bench_walk(&clients, buf, evict);
+	printf("walk: %d slots from memory, %.2f ns per slot, %.0f MB/s of flags\n", clients.nb, ns, sizeof(clients.flags[0]) * 1000 / ns);
+	shared_buf_unref(buf);
+	free(evict);
+	client_table_free(&clients);
+	
+	// two descriptors per client, the table is not bound by FD_SETSIZE here, only by the descriptor limit
+	if( getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max )
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	max_pairs = BENCH_SLOTS;
+	if( getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && (limit.rlim_cur - 64) / 2 < (rlim_t)max_pairs )
+	{
+		max_pairs = (limit.rlim_cur - 64) / 2;
+	}
+	client_table_init(&clients, max_pairs);
+	peers = malloc(max_pairs * sizeof(int));
+	if( peers == NULL )
+	{
+		die_error("benchmark peers");
+	}
+	for( i = 0; i < max_pairs; ++i )
+	{
+		if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1 )
+		{
+			break;
+		}
+		clients.fd[i] = pair[0];
+		peers[i] = pair[1];
+		clients.nb = i + 1;
+	}
+	if( clients.nb == 0 )
+	{
+		die_error("benchmark socketpair");
+	}
+	
+	for( k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); ++k )
+	{
+		buf = shared_buf_frame(FRAME_TEXT, 1, payload, sizes[k]);
+		elapsed = 0;
+		for( r = 0; r < rounds; ++r )
+		{
+			start = monotonic_ns();
+			send_to_all_clients(&clients, buf, -1);
+			elapsed += monotonic_ns() - start;
+			for( i = 0; i < clients.nb; ++i )
+			{
+				while( recv(peers[i], drain, sizeof(drain), MSG_DONTWAIT) > 0 )
+				{
+				}
+			}
+		}
+		printf("fanout: %zu bytes to %d clients, %.0f ns per recipient, %.0f MB/s\n", sizes[k], clients.nb,
+			(double)elapsed / rounds / clients.nb, (double)rounds * clients.nb * buf->len * 1000 / elapsed);
+		shared_buf_unref(buf);
+	}
+	
+	for( i = 0; i < clients.nb; ++i )
+	{
+		if( clients.flags[i] & CF_CLOSING )
+		{
+			fprintf(stderr, "benchmark: send to client %d failed\n", i);
+		}
+		close(clients.fd[i]);
+		close(peers[i]);
+	}
+	free(peers);
+	client_table_free(&clients);
+	
+	return;
+}
+
 int main(int argc, char **argv)
 {
-	if( argc != 2 )
+	int opt, level = LOG_INFO;
+	FILE *log_out = stderr;
+	char *unix_path = NULL;
+	size_t index_mb = INDEX_BUDGET_MB;
+	int compress_level = 0;
+	int bench_rounds = 0;
+	
+	while( (opt = getopt(argc, argv, "l:o:z:u:i:c:b:")) != -1 )
+	{
+		switch( opt )
+		{
+			case 'l':
+				level = parse_log_level(optarg);
+				if( level == -1 )
+				{
+					fprintf(stderr, "Unknown log level %s (debug, info, warn, error)\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'o':
+				log_out = fopen(optarg, "a");
+				if( log_out == NULL )
+				{
+					die_error("log file");
+				}
+				break;
+			case 'z':
+				zerocopy_threshold = strtoul(optarg, NULL, 10);
+				break;
+			case 'u':
+				unix_path = optarg;
+				break;
+			case 'i':
+				index_mb = strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				compress_level = atoi(optarg);
+				if( compress_level < 0 || compress_level > 9 )
+				{
+					fprintf(stderr, "Compression level goes from 1 to 9, 0 disables it\n");
+					exit(-1);
+				}
+				break;
+			case 'b':
+				bench_rounds = atoi(optarg);
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	
+	if( bench_rounds > 0 )
 	{
-		fprintf(stderr, "Usage: %s [port to listen on]\n", argv[0]);
+		fanout_benchmark(bench_rounds);
+		exit(0);
+	}
+	
+	if( argc - optind != 1 )
+	{
+		fprintf(stderr, "Usage: %s [-l log level] [-o log file] [-z zerocopy threshold] [-u unix socket path] [-i search index MB] [-c compression level] [-b benchmark rounds] [port to listen on]\n", argv[0]);
 		exit(-1);
 	}
+	char *port = argv[optind];
 	
 	int server_sock;
 	int client_sock;
@@ -295,7 +3264,7 @@ int main(int argc, char **argv)
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
 	
-	status = getaddrinfo(SERVER, argv[1], &hints, &addrinfo);
+	status = getaddrinfo(SERVER, port, &hints, &addrinfo);
 	if( status != 0 )
 	{
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
@@ -319,160 +3288,175 @@ int main(int argc, char **argv)
 	
 	status = listen(server_sock, SOMAXCONN);
 	
-	int i, j, bytes_recvd, bytes_sent;
-	char buf[MAX_BUFF];
+	// co-located clients can skip the TCP stack by connecting to a unix socket
+	int unix_sock = -1;
+	if( unix_path != NULL )
+	{
+		struct sockaddr_un unix_addr;
+		
+		memset(&unix_addr, 0, sizeof(unix_addr));
+		unix_addr.sun_family = AF_UNIX;
+		if( strlen(unix_path) >= sizeof(unix_addr.sun_path) )
+		{
+			fprintf(stderr, "unix socket path too long: %s\n", unix_path);
+			exit(-1);
+		}
+		strcpy(unix_addr.sun_path, unix_path);
+		
+		unix_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if( unix_sock == -1 )
+		{
+			die_error("unix socket");
+		}
+		// a socket file left behind by a previous run, anything else at that path is not ours to delete
+		struct stat st;
+		if( lstat(unix_path, &st) == 0 )
+		{
+			if( !S_ISSOCK(st.st_mode) )
+			{
+				fprintf(stderr, "%s exists and is not a socket, refusing to replace it\n", unix_path);
+				exit(-1);
+			}
+			unlink(unix_path);
+		}
+		if( bind(unix_sock, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) == -1 )
+		{
+			die_error("bind unix socket");
+		}
+		if( listen(unix_sock, SOMAXCONN) == -1 )
+		{
+			die_error("listen unix socket");
+		}
+	}
+	int listeners[2] = { server_sock, unix_sock };
+	
+	int i, l, k;
 	
-	client_info clients[MAX_CLIENTS];
-	int nb_clients = 0, client_no;
-	char message_buf[MAX_BUFF];
+	client_table clients;
+	long next_expiry = -1;
+	struct timeval timeout;
 	
-	fd_set read_fds;
-	int fdmax = server_sock;
+	client_table_init(&clients, MAX_CLIENTS);
+	backlog.next_seq = 1;
 	
-	char *joined = calloc(MAX_BUFF, sizeof(char));
-	char *left = calloc(MAX_BUFF, sizeof(char));
+	fd_set read_fds;
+	int fdmax = server_sock > unix_sock ? server_sock : unix_sock;
 	
-	fprintf(stderr, "IP address: %s\nPort: %s\n", SERVER, argv[1]);
-	fprintf(stderr, "Server set up - waiting for incoming connections\n");
+	log_start(log_out, level);
+	index_start(&searcher, index_mb);
+	compress_start(compress_level);
+	if( searcher.running && searcher.efd > fdmax )
+	{
+		fdmax = searcher.efd;
+	}
+	log_str(LOG_INFO, "IP address: %s", SERVER);
+	log_str(LOG_INFO, "Port: %s", port);
+	log_int(LOG_INFO, "Zerocopy threshold: %ld bytes", zerocopy_threshold);
+	log_int(LOG_INFO, "Search index: %ld MB", index_mb);
+	log_int(LOG_INFO, "Compression level: %ld", compress_level);
+	if( unix_path != NULL )
+	{
+		log_str(LOG_INFO, "Unix socket: %s", unix_path);
+	}
+	log_msg(LOG_INFO, "Server set up - waiting for incoming connections");
 	
 	for( ;; )
 	{
 		FD_ZERO(&read_fds);
 		FD_SET(server_sock, &read_fds);
-		for( i = 0; i < nb_clients; ++i )
+		if( unix_sock != -1 )
+		{
+			FD_SET(unix_sock, &read_fds);
+		}
+		if( searcher.running )
 		{
-			FD_SET(clients[i].sock, &read_fds);
+			FD_SET(searcher.efd, &read_fds);
 		}
-		status = select(fdmax + 1, &read_fds, NULL, NULL, NULL);
+		for( k = 0; k < nb_handshakes; ++k )
+		{
+			FD_SET(handshakes[k].fd, &read_fds);
+		}
+		for( i = 0; i < clients.nb; ++i )
+		{
+			// detached sessions have no socket
+			if( clients.fd[i] != -1 )
+			{
+				FD_SET(clients.fd[i], &read_fds);
+			}
+		}
+		// wake up in time to expire the detached sessions nobody came back for
+		timeout.tv_sec = next_expiry;
+		timeout.tv_usec = 0;
+		status = select(fdmax + 1, &read_fds, NULL, NULL, next_expiry == -1 ? NULL : &timeout);
 		if( status == -1 )
 		{
 			die_error("select");
 		}
 		
-		if( FD_ISSET(server_sock, &read_fds) )
+		for( l = 0; l < 2; ++l )
 		{
-			// listener has got connection
-			if( nb_clients < MAX_CLIENTS )
+			if( listeners[l] == -1 || !FD_ISSET(listeners[l], &read_fds) )
 			{
-				// we can still add more clients
-				client_no = add_client_to_list(clients, server_sock, &nb_clients, &fdmax);
-				if( client_no > -1 )
-				{
-					snprintf(joined, MAX_BUFF, "Server: [%s] has joined the chat", clients[client_no].pseudo);
-					if( clients[client_no].status != INVISIBLE )
-					{
-						send_to_all_clients(clients, nb_clients, joined, client_no);
-					}
-				}
+				continue;
 			}
-			else
+			// listener has got connection, a new client or one resuming its session
+			accept_client(listeners[l], &fdmax);
+		}
+		for( k = nb_handshakes - 1; k >= 0; --k )
+		{
+			if( FD_ISSET(handshakes[k].fd, &read_fds) && handshake_read(&clients, &handshakes[k]) )
 			{
-				fprintf(stderr, "We don't have any more space to welcome visitors\n");
-				FD_CLR(server_sock, &read_fds);
+				handshakes[k] = handshakes[--nb_handshakes];
 			}
 		}
-		for( i = 0; i < nb_clients; ++i )
+		if( searcher.running && FD_ISSET(searcher.efd, &read_fds) )
+		{
+			index_deliver(&searcher, &clients);
+		}
+		for( i = 0; i < clients.nb; ++i )
 		{
 			// go through the clients list and see if any of them have sent a message
-			if( FD_ISSET(clients[i].sock, &read_fds) )
+			if( clients.fd[i] != -1 && FD_ISSET(clients.fd[i], &read_fds) && !(clients.flags[i] & CF_GONE) )
 			{
-				// found a message
-				memset(&message_buf, 0, MAX_BUFF);
-				bytes_recvd = recv_message(clients[i].sock, message_buf, MAX_BUFF);
-				if( bytes_recvd <= 0 )
-				{
-					snprintf(left, MAX_BUFF, "Server: [%s] has left the chat", clients[i].pseudo);
-					remove_client_from_list(clients, i, &nb_clients);
-					if( clients[i].status != INVISIBLE )
-					{
-						send_to_all_clients(clients, nb_clients, left, -1);
-					}
-				}
-				else
+				// zerocopy completions also make the socket readable
+				zc_reap(&clients, i);
+				if( client_read(&clients, i) == -1 )
 				{
-					// compare the message with special command
-					if( !strncmp(message_buf, LIST, strlen(LIST)) )
-					{
-						// list command found
-						send_list_of_clients(clients[i].sock, clients, nb_clients);
-					}
-					else if( !strncmp(message_buf, "@", 1) )
-					{
-						// find index of pseudo if it exists
-						int pseudo_index = find_user_index(clients, nb_clients, message_buf + 1);
-						if( pseudo_index > -1 )
-						{
-							send_message(clients[pseudo_index].sock, message_buf);
-						}
-					}
-					else if( !strncmp(message_buf, KICK, strlen(KICK)) && clients[i].type == ADMINISTRATOR )
-					{
-						int pseudo_index = find_user_index(clients, nb_clients, message_buf + strlen(KICK) + 1);
-						if( pseudo_index > -1 )
-						{
-							const char *kicked_message = "You have been kicked out from the chat";
-							send_message(clients[pseudo_index].sock, kicked_message);
-							remove_client_from_list(clients, pseudo_index, &nb_clients);
-						}
-					}
-					else if( !strncmp(message_buf, CHANGE, strlen(CHANGE)) )
-					{
-						char *updated_pseudo_msg = calloc(MAX_BUFF, sizeof(char));
-						
-						strncat(updated_pseudo_msg, clients[i].pseudo, strlen(clients[i].pseudo));
-						// change the pseudo and update it in the clients list
-						memset(clients[i].pseudo, '\0', PSEUDO_LEN);
-						strncpy(clients[i].pseudo, message_buf + strlen(CHANGE) + 1, PSEUDO_LEN);
-						
-						if( clients[i].status != INVISIBLE )
-						{
-							// inform on name change if and only if the client is visible to others
-							// send message to all clients informing about the change
-							const char *changed_pseudo = " has changed their pseudo to ";
-							strncat(updated_pseudo_msg, changed_pseudo, strlen(changed_pseudo));
-							strncat(updated_pseudo_msg, clients[i].pseudo, strlen(clients[i].pseudo));
-							
-							send_to_all_clients(clients, nb_clients, updated_pseudo_msg, i);
-						}
-					}
-					else
-					{
-						send_to_all_clients(clients, nb_clients, message_buf, i);
-					}
+					clients.flags[i] |= CF_CLOSING;
 				}
 			}
 		}
+		
+		next_expiry = sweep_clients(&clients);
 	}
 	
 	return 0;
 }
 
-void print_client_info(client_info *ci)
+void print_client_info(int sock, client_info *ci)
 {
-	printf("sock %d\n", ci->sock);
-	printf("ip: %s\n", ci->ip);
-	printf("port: %s\n", ci->ip);
-	printf("pseudo: %s\n", ci->pseudo);
+	log_int(LOG_DEBUG, "sock %ld", sock);
+	log_str(LOG_DEBUG, "ip: %s", ci->ip);
+	log_str(LOG_DEBUG, "port: %s", ci->port);
+	log_str(LOG_DEBUG, "pseudo: %s", ci->pseudo);
 	
-	printf("type: ");
 	switch( ci->type )
 	{
 		case REGULAR:
-			printf("Regular\n");
+			log_msg(LOG_DEBUG, "type: Regular");
 			break;
 		case ADMINISTRATOR:
-			printf("Administrator\n");
+			log_msg(LOG_DEBUG, "type: Administrator");
 			break;
 	}
 	
-	printf("status: ");
 	switch( ci->status )
 	{
 		case VISIBLE:
-			printf("Visible\n");
+			log_msg(LOG_DEBUG, "status: Visible");
 			break;
 		case INVISIBLE:
-			printf("Invisible\n");
+			log_msg(LOG_DEBUG, "status: Invisible");
 			break;
 	}
 	